@@ -0,0 +1,20 @@
+#ifndef __SD_CRC_H
+#define __SD_CRC_H
+
+// Table driven CRCs of the SD SPI protocol. The tables live in flash on
+// AVR; one lookup per byte keeps a 512 byte block well below the time
+// the SPI transfer of it takes.
+
+extern const uint8_t SD_crc7Table[256] PROGMEM;
+extern const uint16_t SD_crc16Table[256] PROGMEM;
+
+// fold one byte into a running CRC16, for loops that overlap it with SPI
+#define SD_CRC16_UPDATE(CRC, B) ((uint16_t)((CRC) << 8) ^ pgm_read_word(&SD_crc16Table[(uint8_t)((CRC) >> 8) ^ (B)]))
+
+// command CRC with the end bit set
+uint8_t SD_crc7(const uint8_t *buf, uint8_t len);
+
+// data block CRC, start from 0 for a new block
+uint16_t SD_crc16(uint16_t crc, const uint8_t *buf, uint16_t len);
+
+#endif
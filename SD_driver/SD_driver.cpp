@@ -1,58 +1,125 @@
 #include "SPI.h"
 #include <Arduino.h>
 #include "SD_driver.h"
+#include "SPI_bus.h"
+#include "fastPin.h"
+#include "SD_crc.h"
 
-#define CS_pin 10
+// chip select, override per board
+#ifndef SD_CS_PIN
+#define SD_CS_PIN 10
+#endif
 
 #define CMD0 0
 #define CMD0_ARG 0x00000000
-#define CMD0_CRC 0x94
 
 // SEND IF_COND
 #define CMD8 8
 #define CMD8_ARG 0x000001AA
-#define CMD8_CRC 0x86 //(1000011 << 1)
 
 // READ CSD
 #define CMD9 9
 #define CMD9_ARG 0x00000000
-#define CMD9_CRC 0x00
 
 // Read OCR
 #define CMD58 58
 #define CMD58_ARG 0x00000000
-#define CMD58_CRC 0x00
 
 #define CMD55 55
 #define CMD55_ARG 0x00000000
-#define CMD55_CRC 0x00
 
 #define ACMD41 41
 #define ACMD41_ARG 0x40000000
-#define ACMD41_CRC 0x00
+#define ACMD41_V1_ARG 0x00000000
+
+// SET_BLOCKLEN
+#define CMD16 16
 
 // Read Single Block
 #define CMD17 17
-#define CMD17_CRC 0x95
-#define SD_MAX_READ_ATTEMPTS 4500
 
 // Write Single Block
 #define CMD24 24
-#define CMD24_CRC 0x00
-#define SD_MAX_WRITE_ATTEMPTS 3907
+
+// SEND_STATUS
+#define CMD13 13
+#define CMD13_ARG 0x00000000
+
+// default command phase deadlines in microseconds
+#define SD_R1_TIMEOUT_US 1000UL
+#define SD_READ_TIMEOUT_US 100000UL
+#define SD_WRITE_TIMEOUT_US 250000UL
+#define SD_WRITE_TIMEOUT_HC_US 500000UL // SDXC allows 500ms
+#define SD_ERASE_TIMEOUT_US 5000000UL
+#define SD_OP_COND_TIMEOUT_US 1000000UL // ACMD41 initialization limit
+#define SD_RESUME_CMD0_TRIES 10
+
+// latency histogram of reads, writes and busy waits, 0 to leave it out
+#ifndef SD_LATENCY_HIST
+#define SD_LATENCY_HIST 1
+#endif
+#define SD_HIST_BUCKETS 18
+
+// operation counters, 0 to leave them out
+#ifndef SD_STATS
+#define SD_STATS 1
+#endif
+
+// stack copy SD_spiSend() hands to the buffer transfer of generic cores
+#ifndef SD_SPI_SEND_CHUNK
+#define SD_SPI_SEND_CHUNK 64
+#endif
 
 // Read Multiple Block
 #define CMD18 18
-#define CMD18_CRC 0x00
 
 // STOP_MULTIPLE_READ
 #define CMD12 12
 #define CMD12_ARG 0x00000000
-#define CMD12_CRC 0x00
 
 // Write Multiple Block
 #define CMD25 25
-#define CMD25_CRC 0x00
+
+// SD_STATUS
+#define ACMD13 13
+#define ACMD13_ARG 0x00000000
+#define SD_STATUS_LEN 64
+
+// SET_WR_BLK_ERASE_COUNT
+#define ACMD23 23
+#define ACMD23_MAX_BLOCKS 0x007FFFFF
+
+// ERASE_WR_BLK_START_ADDR, ERASE_WR_BLK_END_ADDR, ERASE
+#define CMD32 32
+#define CMD33 33
+#define CMD38 38
+#define CMD38_ARG 0x00000000
+#define CCC_ERASE 0x0020
+
+// CRC_ON_OFF
+#define CMD59 59
+#define CMD59_ARG_ON 0x00000001
+#define CMD59_ARG_OFF 0x00000000
+
+// check data CRCs and protect writes with them, see SD_setCrcMode()
+#ifndef SD_CRC_MODE
+#define SD_CRC_MODE 0
+#endif
+
+// attempts added to a transfer for CRC errors before it fails
+#ifndef SD_CRC_RETRIES
+#define SD_CRC_RETRIES 3
+#endif
+
+// error token with no error bit, stands for a data CRC mismatch
+#define SD_TOKEN_CRC_BAD 0x00
+
+// data response of a block rejected for its CRC
+#define SD_DATA_CRC_ERR 0x0B
+
+// R1 of a command the card dropped for its CRC, 0xFF is a timeout, X is
+// evaluated twice
+#define SD_CMD_CRC_ERR(X) (!((X) & 0x80) && ((X) & 0x08))
 
 #define PARAM_ERROR(X) X & 0b01000000
 #define ADDR_ERROR(X) X & 0b00100000
@@ -88,13 +155,315 @@
 #define SD_TOKEN_ERROR(X) X & 0b00000001
 
 #define SD_START_TOKEN 0xFE
+#define SD_MULTI_START_TOKEN 0xFC
+#define SD_STOP_TRAN_TOKEN 0xFD
 #define SD_BLOCK_LEN 512
 
-#define CS_DISABLE() digitalWrite(CS_pin, HIGH)
-#define CS_ENABLE() digitalWrite(CS_pin, LOW)
+typedef FastPin<SD_CS_PIN> sdCsPin;
+
+#define CS_DISABLE() sdCsPin::high()
+#define CS_ENABLE() sdCsPin::low()
+
+// spec limit for the identification phase
+#define SD_INIT_CLOCK_HZ 400000UL
+
+// fastest SPI clock the board runs reliably, override per board
+#ifndef SD_MAX_CLOCK_HZ
+#if defined(ESP8266)
+#define SD_MAX_CLOCK_HZ 20000000UL
+#else
+#define SD_MAX_CLOCK_HZ (F_CPU / 2)
+#endif
+#endif
+
+#define CSD_STRUCTURE(X) ((X[0] >> 6) & 0x03)
+
+static sd_card_info_t cardInfo;
+static sd_status_t cardStatus;
+
+// SDSC cards take byte addresses, SDHC/SDXC block addresses
+#define SD_ADDR(X) ((cardInfo.type == SD_CARD_SDHC) ? (X) : ((X) << 9))
+
+// deadlines indexed by sd_card_type_t
+static sd_timeouts_t timeouts[] = {
+    {SD_R1_TIMEOUT_US, SD_READ_TIMEOUT_US, SD_WRITE_TIMEOUT_US},
+    {SD_R1_TIMEOUT_US, SD_READ_TIMEOUT_US, SD_WRITE_TIMEOUT_US},
+    {SD_R1_TIMEOUT_US, SD_READ_TIMEOUT_US, SD_WRITE_TIMEOUT_HC_US},
+};
+
+#define SD_TIMEOUT(X) (timeouts[cardInfo.type].X)
+#define SD_EXPIRED(START, US) ((uint32_t)(micros() - (START)) > (US))
+
+#if SD_LATENCY_HIST
+static uint32_t latencyHist[3][SD_HIST_BUCKETS];
+#endif
+
+#if SD_STATS
+static sd_stats_t stats;
+#define SD_STAT_ADD(FIELD, N) (stats.FIELD += (N))
+#else
+#define SD_STAT_ADD(FIELD, N)
+#endif
+#define SD_STAT_INC(FIELD) SD_STAT_ADD(FIELD, 1)
+
+// non-blocking write state
+static bool asyncBusy = false;
+static uint32_t asyncStart;
+static sd_ret_t asyncResult = SD_WRITE_SUCCESS;
+
+// cleared once the card rejects ACMD23
+static bool preEraseSupported = true;
+
+// bus slot of the card, registered by SD_init()
+static uint8_t sdBus = BUS_NONE;
+
+// open CMD18 stream, stopped while another device has the bus and
+// reopened at streamNext by the next SD_readMultipleSec()
+static bool streamOpen = false;
+static bool streamParked = false;
+static uint32_t streamNext;
+
+// open CMD25 stream, parked the same way and reopened at wrStreamNext
+static bool wrStreamOpen = false;
+static bool wrStreamParked = false;
+static uint32_t wrStreamNext;
+
+static void SD_parkStream();
+static void SD_parkWriteStream();
+static void SD_preempt();
+
+// CMD59 state of the card
+static bool crcMode = SD_CRC_MODE;
+
+// Bulk data phase transfers. Per-byte SPI.transfer() calls spend most of a
+// sector in call overhead, so the data phase goes through these instead.
+#if defined(__AVR__)
+static void SD_spiReceive(uint8_t *buf, uint16_t len)
+{
+    SD_STAT_ADD(bytesRead, len);
+    if (len == 0)
+        return;
+
+    // keep the next byte clocking while the previous one is stored
+    SPDR = 0xFF;
+    for (uint16_t i = 0; i < len - 1; i++)
+    {
+        while (!(SPSR & _BV(SPIF)))
+            ;
+        uint8_t b = SPDR;
+        SPDR = 0xFF;
+        buf[i] = b;
+    }
+    while (!(SPSR & _BV(SPIF)))
+        ;
+    buf[len - 1] = SPDR;
+}
+
+static void SD_spiSend(const uint8_t *buf, uint16_t len)
+{
+    SD_STAT_ADD(bytesWritten, len);
+    if (len == 0)
+        return;
+
+    // fetch the next byte while the current one is shifted out
+    SPDR = buf[0];
+    for (uint16_t i = 1; i < len; i++)
+    {
+        uint8_t b = buf[i];
+        while (!(SPSR & _BV(SPIF)))
+            ;
+        SPDR = b;
+    }
+    while (!(SPSR & _BV(SPIF)))
+        ;
+}
+
+// CRC mode variants, the table lookup of a byte runs while the next one
+// is on the wire
+static uint16_t SD_spiReceiveCrc(uint8_t *buf, uint16_t len)
+{
+    uint16_t crc = 0;
+
+    SD_STAT_ADD(bytesRead, len);
+    if (len == 0)
+        return crc;
+
+    SPDR = 0xFF;
+    for (uint16_t i = 0; i < len - 1; i++)
+    {
+        while (!(SPSR & _BV(SPIF)))
+            ;
+        uint8_t b = SPDR;
+        SPDR = 0xFF;
+        buf[i] = b;
+        crc = SD_CRC16_UPDATE(crc, b);
+    }
+    while (!(SPSR & _BV(SPIF)))
+        ;
+    buf[len - 1] = SPDR;
+    return SD_CRC16_UPDATE(crc, buf[len - 1]);
+}
+
+static uint16_t SD_spiSendCrc(const uint8_t *buf, uint16_t len)
+{
+    uint16_t crc = 0;
+
+    SD_STAT_ADD(bytesWritten, len);
+    if (len == 0)
+        return crc;
+
+    SPDR = buf[0];
+    crc = SD_CRC16_UPDATE(crc, buf[0]);
+    for (uint16_t i = 1; i < len; i++)
+    {
+        uint8_t b = buf[i];
+        crc = SD_CRC16_UPDATE(crc, b);
+        while (!(SPSR & _BV(SPIF)))
+            ;
+        SPDR = b;
+    }
+    while (!(SPSR & _BV(SPIF)))
+        ;
+    return crc;
+}
+#elif defined(ESP8266)
+static void SD_spiReceive(uint8_t *buf, uint16_t len)
+{
+    SD_STAT_ADD(bytesRead, len);
+
+    // a NULL output buffer clocks out 0xFF from the hardware FIFO
+    SPI.transferBytes(NULL, buf, len);
+}
+
+static void SD_spiSend(const uint8_t *buf, uint16_t len)
+{
+    SD_STAT_ADD(bytesWritten, len);
+    SPI.writeBytes(buf, len);
+}
+#else
+static void SD_spiReceive(uint8_t *buf, uint16_t len)
+{
+    SD_STAT_ADD(bytesRead, len);
+
+    // in-place buffer transfer, card expects 0xFF on DI while sending
+    memset(buf, 0xFF, len);
+    SPI.transfer(buf, len);
+}
+
+static void SD_spiSend(const uint8_t *buf, uint16_t len)
+{
+    SD_STAT_ADD(bytesWritten, len);
+
+    // buffer transfer overwrites its argument, send copies of the data
+    uint8_t chunk[SD_SPI_SEND_CHUNK];
+    while (len > 0)
+    {
+        uint16_t n = (len < sizeof(chunk)) ? len : sizeof(chunk);
+        memcpy(chunk, buf, n);
+        SPI.transfer(chunk, n);
+        buf += n;
+        len -= n;
+    }
+}
+#endif
+
+#if !defined(__AVR__)
+// the buffer transfers leave nothing to overlap with, CRC the block after
+static uint16_t SD_spiReceiveCrc(uint8_t *buf, uint16_t len)
+{
+    SD_spiReceive(buf, len);
+    return SD_crc16(0, buf, len);
+}
+
+static uint16_t SD_spiSendCrc(const uint8_t *buf, uint16_t len)
+{
+    SD_spiSend(buf, len);
+    return SD_crc16(0, buf, len);
+}
+#endif
+
+// data phase of a read followed by its CRC16, false on a mismatch
+static bool SD_receiveData(uint8_t *buf, uint16_t len)
+{
+    uint16_t crc = 0, cardCrc;
+
+    if (crcMode)
+        crc = SD_spiReceiveCrc(buf, len);
+    else
+        SD_spiReceive(buf, len);
+
+    cardCrc = (uint16_t)SPI.transfer(0xFF) << 8;
+    cardCrc |= SPI.transfer(0xFF);
+
+    if (crcMode && crc != cardCrc)
+    {
+        SD_STAT_INC(crcErrors);
+        return false;
+    }
+    return true;
+}
+
+// data phase of a write followed by its CRC16, ignored by the card
+// unless CRC mode is on
+static void SD_sendData(const uint8_t *buf, uint16_t len)
+{
+    uint16_t crc = 0xFFFF;
+
+    if (crcMode)
+        crc = SD_spiSendCrc(buf, len);
+    else
+        SD_spiSend(buf, len);
+
+    SPI.transfer((uint8_t)(crc >> 8));
+    SPI.transfer((uint8_t)crc);
+}
+
+// one more attempt at a transfer that hit a CRC error
+static bool SD_crcRetry(uint8_t *tries)
+{
+    if (*tries >= SD_CRC_RETRIES)
+        return false;
+
+    (*tries)++;
+    SD_STAT_INC(retries);
+    return true;
+}
+
+// set between a successful SD_select() and its SD_deselect()
+static bool sdSelected = false;
+
+static bool SD_select()
+{
+    // the card keeps the bus for as long as it is selected, another device
+    // that keeps it fails the command
+    if (!BUS_acquire(sdBus))
+        return false;
+    SPI.transfer(0xFF);
+    CS_ENABLE();
+    SPI.transfer(0xFF);
+    sdSelected = true;
+    return true;
+}
+
+static void SD_deselect()
+{
+    // after a failed select the bus belongs to another device
+    if (!sdSelected)
+        return;
+    sdSelected = false;
+
+    SPI.transfer(0xFF);
+    CS_DISABLE();
+    SPI.transfer(0xFF);
+    BUS_release(sdBus);
+}
 
 void SD_powerUpSeq()
 {
+    // CMD0 fails next if the bus can't be had
+    if (!BUS_acquire(sdBus))
+        return;
+
     // make sure card is deselected
     CS_DISABLE();
 
@@ -108,57 +477,164 @@ void SD_powerUpSeq()
     // deselect SD card
     CS_DISABLE();
     SPI.transfer(0xFF);
+
+    BUS_release(sdBus);
 }
 
-void SD_command(uint8_t cmd, uint32_t arg, uint8_t crc)
+void SD_command(uint8_t cmd, uint32_t arg)
 {
-    // transmit command to sd card
-    SPI.transfer(cmd | 0x40);
+    uint8_t frame[5];
+#if SD_STATS
+    switch (cmd)
+    {
+    case CMD17:
+        stats.cmd17++;
+        break;
+    case CMD18:
+        stats.cmd18++;
+        break;
+    case CMD24:
+        stats.cmd24++;
+        break;
+    case CMD25:
+        stats.cmd25++;
+        break;
+    }
+#endif
+
+    // command and argument
+    frame[0] = cmd | 0x40;
+    frame[1] = (uint8_t)(arg >> 24);
+    frame[2] = (uint8_t)(arg >> 16);
+    frame[3] = (uint8_t)(arg >> 8);
+    frame[4] = (uint8_t)(arg);
 
-    // transmit argument
-    SPI.transfer((uint8_t)(arg >> 24));
-    SPI.transfer((uint8_t)(arg >> 16));
-    SPI.transfer((uint8_t)(arg >> 8));
-    SPI.transfer((uint8_t)(arg));
+    // transmit command to sd card
+    for (uint8_t i = 0; i < sizeof(frame); i++)
+        SPI.transfer(frame[i]);
 
-    // transmit crc
-    SPI.transfer(crc | 0x01);
+    // transmit crc, checked by the card for CMD0 and CMD8 and for every
+    // command once CRC mode is on
+    SPI.transfer(SD_crc7(frame, sizeof(frame)));
 }
 
 uint8_t SD_readRes1()
 {
-    uint8_t i = 0, res1;
+    uint8_t res1;
+    uint32_t start = micros();
 
     // keep polling until actual data received
     while ((res1 = SPI.transfer(0xFF)) == 0xFF)
     {
-        i++;
-
-        // if no data received for 8 bytes, break
-        if (i > 8)
+        // if no data received before the deadline, break
+        if (SD_EXPIRED(start, SD_TIMEOUT(r1Us)))
+        {
+            SD_STAT_INC(timeouts);
             break;
+        }
     }
 
     return res1;
 }
 
+static void SD_histRecord(sd_hist_t kind, uint32_t us)
+{
+#if SD_LATENCY_HIST
+    uint8_t bucket = 0;
+
+    // bucket n holds [2^n, 2^(n+1)) us, last one everything above
+    while (us > 1 && bucket < SD_HIST_BUCKETS - 1)
+    {
+        us >>= 1;
+        bucket++;
+    }
+    latencyHist[kind][bucket]++;
+#endif
+}
+
+uint8_t SD_waitToken(uint32_t timeoutUs)
+{
+    uint8_t read;
+    uint32_t start = micros();
+
+    // wait for a data token, 0xFF on timeout
+    while ((read = SPI.transfer(0xFF)) == 0xFF)
+    {
+        if (SD_EXPIRED(start, timeoutUs))
+        {
+            SD_STAT_INC(timeouts);
+            break;
+        }
+    }
+
+    SD_histRecord(SD_HIST_READ, micros() - start);
+    return read;
+}
+
+uint8_t SD_waitResponse(uint32_t timeoutUs)
+{
+    uint8_t read;
+    uint32_t start = micros();
+
+    // wait for a data response token, 0xFF on timeout
+    while ((read = SPI.transfer(0xFF)) == 0xFF)
+    {
+        if (SD_EXPIRED(start, timeoutUs))
+        {
+            SD_STAT_INC(timeouts);
+            break;
+        }
+    }
+    return read;
+}
+
+uint8_t SD_waitReady(uint32_t timeoutUs)
+{
+    uint8_t ready = 1;
+    uint32_t start = micros();
+
+    // card holds DO low while it is busy programming
+    while (SPI.transfer(0xFF) == 0x00)
+    {
+        if (SD_EXPIRED(start, timeoutUs))
+        {
+            SD_STAT_INC(timeouts);
+            ready = 0;
+            break;
+        }
+
+        // the card may be deselected while busy, let a higher priority
+        // device use the bus in the meantime
+        if (BUS_shouldYield(sdBus))
+        {
+            SD_deselect();
+            if (!SD_select())
+            {
+                ready = 0;
+                break;
+            }
+        }
+    }
+
+    SD_histRecord(SD_HIST_BUSY, micros() - start);
+    SD_STAT_ADD(busyUs, micros() - start);
+    return ready;
+}
+
 uint8_t SD_goIdleState()
 {
     // assert chip select
-    SPI.transfer(0xFF);
-    CS_ENABLE();
-    SPI.transfer(0xFF);
+    if (!SD_select())
+        return 0xFF;
 
     // send CMD0
-    SD_command(CMD0, CMD0_ARG, CMD0_CRC);
+    SD_command(CMD0, CMD0_ARG);
 
     // read response
     uint8_t res1 = SD_readRes1();
 
     // deassert chip select
-    SPI.transfer(0xFF);
-    CS_DISABLE();
-    SPI.transfer(0xFF);
+    SD_deselect();
 
     return res1;
 }
@@ -182,79 +658,73 @@ void SD_readRes3_7(uint8_t *res)
 void SD_sendIfCond(uint8_t *res)
 {
     // assert chip select
-    SPI.transfer(0xFF);
-    CS_ENABLE();
-    SPI.transfer(0xFF);
+    if (!SD_select())
+    {
+        res[0] = 0xFF;
+        return;
+    }
 
     // send CMD8
-    SD_command(CMD8, CMD8_ARG, CMD8_CRC);
+    SD_command(CMD8, CMD8_ARG);
 
     // read response
     SD_readRes3_7(res);
 
     // deassert chip select
-    SPI.transfer(0xFF);
-    CS_DISABLE();
-    SPI.transfer(0xFF);
+    SD_deselect();
 }
 
 void SD_readOCR(uint8_t *res)
 {
     // assert chip select
-    SPI.transfer(0xFF);
-    CS_ENABLE();
-    SPI.transfer(0xFF);
+    if (!SD_select())
+    {
+        res[0] = 0xFF;
+        return;
+    }
 
     // send CMD58
-    SD_command(CMD58, CMD58_ARG, CMD58_CRC);
+    SD_command(CMD58, CMD58_ARG);
 
     // read response
     SD_readRes3_7(res);
 
     // deassert chip select
-    SPI.transfer(0xFF);
-    CS_DISABLE();
-    SPI.transfer(0xFF);
+    SD_deselect();
 }
 
 uint8_t SD_sendApp()
 {
     // assert chip select
-    SPI.transfer(0xFF);
-    CS_ENABLE();
-    SPI.transfer(0xFF);
+    if (!SD_select())
+        return 0xFF;
 
     // send CMD0
-    SD_command(CMD55, CMD55_ARG, CMD55_CRC);
+    SD_command(CMD55, CMD55_ARG);
 
     // read response
     uint8_t res1 = SD_readRes1();
 
     // deassert chip select
-    SPI.transfer(0xFF);
-    CS_DISABLE();
-    SPI.transfer(0xFF);
+    SD_deselect();
 
     return res1;
 }
 
-uint8_t SD_sendOpCond()
+uint8_t SD_sendOpCond(uint32_t arg)
 {
     // assert chip select
-    SPI.transfer(0xFF);
-    CS_ENABLE();
-    SPI.transfer(0xFF);
+    if (!SD_select())
+        return 0xFF;
 
-    // send CMD0
-    SD_command(ACMD41, ACMD41_ARG, ACMD41_CRC);
+    // send ACMD41
+    SD_command(ACMD41, arg);
 
     // read response
     uint8_t res1 = SD_readRes1();
 
     // deassert chip select
-    SPI.transfer(0xFF);
-    CS_DISABLE();
-    SPI.transfer(0xFF);
+    SD_deselect();
 
     return res1;
 }
@@ -361,6 +831,8 @@ void SD_printR3(uint8_t *res)
 
 void SD_printDataErrToken(uint8_t token)
 {
+    if (token == SD_TOKEN_CRC_BAD)
+        Serial.print("\tData CRC mismatch\r\n");
     if (SD_TOKEN_OOR(token))
         Serial.print("\tData out of range\r\n");
     if (SD_TOKEN_CECC(token))
@@ -374,7 +846,6 @@ void SD_printDataErrToken(uint8_t token)
 uint8_t SD_read_start(uint8_t *buf, uint16_t read_len, uint8_t *token)
 {
     uint8_t res1, read;
-    uint16_t readAttempts;
 
     // read R1
     res1 = SD_readRes1();
@@ -382,27 +853,19 @@ uint8_t SD_read_start(uint8_t *buf, uint16_t read_len, uint8_t *token)
     // if response received from card
     if (res1 == SD_READY)
     {
-        // wait for a response token (timeout = 100ms)
-        readAttempts = 0;
-
-        while ((read = SPI.transfer(0xFF)) != 0xFE)
-        {
-
-            if (readAttempts == SD_MAX_READ_ATTEMPTS)
-                break;
-            readAttempts++;
-        }
+        // wait for a response token
+        read = SD_waitToken(SD_TIMEOUT(readUs));
 
         // if response token is 0xFE
         if (read == 0xFE)
         {
-            // read 512 byte block
-            for (uint16_t i = 0; i < read_len; i++)
-                *buf++ = SPI.transfer(0xFF);
+            // read 512 byte block and its 16-bit CRC
+            if (!SD_receiveData(buf, read_len))
+                read = SD_TOKEN_CRC_BAD;
 
-            // read 16-bit CRC
-            SPI.transfer(0xFF);
-            SPI.transfer(0xFF);
+            // CMD9 reads a 16 byte register through here as well
+            else if (read_len == SD_BLOCK_LEN)
+                SD_STAT_INC(sectorsRead);
         }
 
         // set token to card response
@@ -416,19 +879,16 @@ uint8_t SD_readCSD(uint8_t *CSD)
 {
     uint8_t token, res1;
     // assert chip select
-    SPI.transfer(0xFF);
-    CS_ENABLE();
-    SPI.transfer(0xFF);
+    if (!SD_select())
+        return SD_READ_ERROR;
 
     // send CMD0
-    SD_command(CMD9, CMD9_ARG, CMD9_CRC);
+    SD_command(CMD9, CMD9_ARG);
 
     res1 = SD_read_start(CSD, 16, &token);
 
     // deassert chip select
-    SPI.transfer(0xFF);
-    CS_DISABLE();
-    SPI.transfer(0xFF);
+    SD_deselect();
 
     if (res1 == SD_READY)
     {
@@ -452,46 +912,152 @@ uint8_t SD_readCSD(uint8_t *CSD)
     }
 }
 
+uint32_t SD_setClock(uint32_t hz)
+{
+    // takes effect with the next transaction of the card
+    BUS_setClock(sdBus, hz);
+
+#if defined(ESP8266)
+    return hz;
+#else
+    uint8_t i = 0;
+
+    // SPISettings picks the fastest of the /2../128 dividers not above hz
+    while (i < 6 && (F_CPU >> (i + 1)) > hz)
+        i++;
+    return F_CPU >> (i + 1);
+#endif
+}
+
+uint8_t SD_setBlockLen(uint32_t len)
+{
+    // assert chip select
+    if (!SD_select())
+        return 0xFF;
+
+    // send CMD16
+    SD_command(CMD16, len);
+
+    // read response
+    uint8_t res1 = SD_readRes1();
+
+    // deassert chip select
+    SD_deselect();
+
+    return res1;
+}
+
+static uint8_t SD_crcOnOff(bool enable)
+{
+    // assert chip select
+    if (!SD_select())
+        return 0xFF;
+
+    // send CMD59
+    SD_command(CMD59, enable ? CMD59_ARG_ON : CMD59_ARG_OFF);
+
+    // read response
+    uint8_t res1 = SD_readRes1();
+
+    // deassert chip select
+    SD_deselect();
+
+    return res1;
+}
+
+void SD_parseCSD(uint8_t *csd)
+{
+    // TRAN_SPEED multiplier x10 and rate unit
+    static const uint8_t tranMult[] = {0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80};
+    static const uint32_t tranUnit[] = {10000UL, 100000UL, 1000000UL, 10000000UL};
+
+    cardInfo.csdVersion = CSD_STRUCTURE(csd) + 1;
+    cardInfo.tranSpeed = tranMult[(csd[3] >> 3) & 0x0F] * ((csd[3] & 0x07) < 4 ? tranUnit[csd[3] & 0x07] : 0);
+    cardInfo.blockLen = 1 << (csd[5] & 0x0F);
+    cardInfo.ccc = ((uint16_t)csd[4] << 4) | (csd[5] >> 4);
+
+    if (CSD_STRUCTURE(csd) == 1)
+    {
+        // CSD v2: capacity = (C_SIZE + 1) * 512KB
+        uint32_t cSize = ((uint32_t)(csd[7] & 0x3F) << 16) | ((uint32_t)csd[8] << 8) | csd[9];
+        cardInfo.sectors = (cSize + 1) << 10;
+    }
+    else
+    {
+        // CSD v1: capacity = (C_SIZE + 1) * 2^(C_SIZE_MULT + 2) * 2^READ_BL_LEN
+        uint32_t cSize = ((uint32_t)(csd[6] & 0x03) << 10) | ((uint32_t)csd[7] << 2) | (csd[8] >> 6);
+        uint8_t cSizeMult = ((csd[9] & 0x03) << 1) | (csd[10] >> 7);
+        cardInfo.sectors = (cSize + 1) << (cSizeMult + 2 + (csd[5] & 0x0F) - 9);
+    }
+}
+
+sd_card_info_t SD_getCardInfo()
+{
+    return cardInfo;
+}
+
 uint8_t SD_init()
 {
     uint8_t csd_reg[16];
-    SPI.begin();
-    SPI.setDataMode(SPI_MODE0);
-    SPI.setClockDivider(SPI_CLOCK_DIV2);
-    pinMode(CS_pin, OUTPUT);
+    uint32_t opCondArg = ACMD41_ARG;
+
+    // identify the card at no more than 400kHz
+    sdBus = BUS_register(SD_CS_PIN, SD_INIT_CLOCK_HZ, SPI_MODE0, BUS_PRIO_LOW);
+    if (sdBus == BUS_NONE)
+        return SD_INIT_ERROR;
+    BUS_setPreempt(sdBus, SD_preempt);
+
+    memset(&cardInfo, 0, sizeof(cardInfo));
+    memset(&cardStatus, 0, sizeof(cardStatus));
+    cardInfo.clock = SD_setClock(SD_INIT_CLOCK_HZ);
 
     uint8_t res[5], cmdAttempts = 0;
 
+    asyncBusy = false;
+    asyncResult = SD_WRITE_SUCCESS;
+    preEraseSupported = true;
+    streamOpen = false;
+    streamParked = false;
+    wrStreamOpen = false;
+    wrStreamParked = false;
+
     SD_powerUpSeq();
 
     // command card to idle
     while ((res[0] = SD_goIdleState()) != 0x01)
     {
+        SD_STAT_INC(retries);
         cmdAttempts++;
         if (cmdAttempts > 50)
         {
             if (res[0] == 0)
-            {
                 Serial.println("Card Not Found!");
-            }
-            else
-                // SD_printR1(res[0]);
-                return SD_INIT_ERROR;
+            // SD_printR1(res[0]);
+            return SD_INIT_ERROR;
         }
     }
 
     // send interface conditions
     SD_sendIfCond(res);
-    if (res[0] != 0x01)
+    if (res[0] == 0x01)
     {
-        // SD_printR1(res[0]);
-        return SD_INIT_ERROR;
+        // check echo pattern
+        if (res[4] != 0xAA)
+        {
+            // SD_printR7(res);
+            return SD_INIT_ERROR;
+        }
+        cardInfo.type = SD_CARD_SDSC_V2;
     }
-
-    // check echo pattern
-    if (res[4] != 0xAA)
+    else if (ILLEGAL_CMD(res[0]))
+    {
+        // version 1 card, no CMD8 and no high capacity support
+        cardInfo.type = SD_CARD_SDSC_V1;
+        opCondArg = ACMD41_V1_ARG;
+    }
+    else
     {
-        // SD_printR7(res);
+        // SD_printR1(res[0]);
         return SD_INIT_ERROR;
     }
 
@@ -508,50 +1074,244 @@ uint8_t SD_init()
         // if no error in response
         if (res[0] < 2)
         {
-            res[0] = SD_sendOpCond();
+            res[0] = SD_sendOpCond(opCondArg);
         }
 
         // wait
         delay(10);
 
-        cmdAttempts++;
+        if (cmdAttempts++)
+            SD_STAT_INC(retries);
     } while (res[0] != SD_READY);
 
-    // read OCR
-    SD_readOCR(res);
-    // check card is ready
-    if (!(res[1] & 0x80))
+    if (cardInfo.type == SD_CARD_SDSC_V2)
     {
-        // SD_printR3(res);
-        return SD_INIT_ERROR;
+        // read OCR
+        SD_readOCR(res);
+        // check card is ready
+        if (!(res[1] & 0x80))
+        {
+            // SD_printR3(res);
+            return SD_INIT_ERROR;
+        }
+        cardInfo.ocr = ((uint32_t)res[1] << 24) | ((uint32_t)res[2] << 16) | ((uint32_t)res[3] << 8) | res[4];
+
+        if (res[1] & 0x40)
+            cardInfo.type = SD_CARD_SDHC;
     }
+
+    // checked from here on, CSD and SD Status included
+    if (crcMode && SD_crcOnOff(true) != SD_READY)
+        return SD_INIT_ERROR;
+
+    // byte addressed cards may default to another block length
+    if (cardInfo.type != SD_CARD_SDHC && SD_setBlockLen(SD_BLOCK_LEN) != SD_READY)
+        return SD_INIT_ERROR;
+
+    if (SD_readCSD(csd_reg) != SD_READ_SUCCESS)
+        return SD_INIT_ERROR;
+    SD_parseCSD(csd_reg);
+
+    // ramp up to the fastest clock both card and board support
+    if (cardInfo.tranSpeed > SD_MAX_CLOCK_HZ || cardInfo.tranSpeed == 0)
+        cardInfo.clock = SD_setClock(SD_MAX_CLOCK_HZ);
     else
+        cardInfo.clock = SD_setClock(cardInfo.tranSpeed);
+
+    // allocation unit geometry, optional for the filesystem
+    if (SD_readStatus(&cardStatus) != SD_READ_SUCCESS)
+        memset(&cardStatus, 0, sizeof(cardStatus));
+
+    if (cardInfo.type == SD_CARD_SDHC)
+        Serial.println("Card Type: SDHC");
+    else
+        Serial.println("Card Type: SDSC");
+
+    return SD_INIT_SUCCESS;
+}
+
+uint8_t SD_resume()
+{
+    uint8_t res[5], cmdAttempts = 0;
+    uint32_t opCondArg = (cardInfo.type == SD_CARD_SDSC_V1) ? ACMD41_V1_ARG : ACMD41_ARG;
+    uint32_t start;
+
+    // nothing to resume before a successful SD_init()
+    if (sdBus == BUS_NONE || cardInfo.sectors == 0)
+        return SD_INIT_ERROR;
+
+    asyncBusy = false;
+    asyncResult = SD_WRITE_SUCCESS;
+
+    // the card comes back idle under the streams a brownout cut off, they
+    // are reopened at their next block by their next call
+    streamParked = streamOpen;
+    wrStreamParked = wrStreamOpen;
+    SD_deselect();
+
+    // identification runs at no more than 400kHz again
+    SD_setClock(SD_INIT_CLOCK_HZ);
+    SD_powerUpSeq();
+
+    // command card to idle
+    while (SD_goIdleState() != 0x01)
     {
-        if (res[1] & 0x40)
-            Serial.println("Card Type: SDHC");
+        SD_STAT_INC(retries);
+        if (++cmdAttempts >= SD_RESUME_CMD0_TRIES)
+            return SD_INIT_ERROR;
     }
+
+    // version 2 cards take HCS in ACMD41 only after CMD8
+    if (cardInfo.type != SD_CARD_SDSC_V1)
+    {
+        SD_sendIfCond(res);
+        if (res[0] != 0x01 || res[4] != 0xAA)
+            return SD_INIT_ERROR;
+    }
+
+    // poll back to back instead of the 10ms spaced attempts of SD_init()
+    start = micros();
+    do
+    {
+        if (SD_EXPIRED(start, SD_OP_COND_TIMEOUT_US))
+            return SD_INIT_ERROR;
+
+        res[0] = SD_sendApp();
+        if (res[0] < 2)
+            res[0] = SD_sendOpCond(opCondArg);
+
+        if (res[0] != SD_READY)
+            SD_STAT_INC(retries);
+    } while (res[0] != SD_READY);
+
+    // CMD0 turned CRC checking off again
+    if (crcMode && SD_crcOnOff(true) != SD_READY)
+        return SD_INIT_ERROR;
+
+    // OCR, CSD and SD Status are those of the same card, skip reading them
+    if (cardInfo.type != SD_CARD_SDHC && SD_setBlockLen(SD_BLOCK_LEN) != SD_READY)
+        return SD_INIT_ERROR;
+
+    // back to the clock negotiated by SD_init()
+    SD_setClock(cardInfo.clock);
+
     return SD_INIT_SUCCESS;
 }
 
-uint8_t SD_readSingleBlock(uint32_t addr, uint8_t *buf, uint8_t *token)
+sd_ret_t SD_poll()
 {
-    // set token to none
-    *token = 0xFF;
+    uint8_t res1, res2;
 
-    // assert chip select
-    SPI.transfer(0xFF);
-    CS_ENABLE();
-    SPI.transfer(0xFF);
+    if (!asyncBusy)
+        return asyncResult;
 
-    // send CMD17
-    SD_command(CMD17, addr, CMD17_CRC);
+    // assert chip select, a bus kept by another device counts as busy
+    bool selected = SD_select();
 
-    uint8_t res1 = SD_read_start(buf, SD_BLOCK_LEN, token);
+    // card holds DO low while programming
+    if (!selected || SPI.transfer(0xFF) == 0x00)
+    {
+        // deassert chip select, bus is free for other devices
+        SD_deselect();
+
+        if (SD_EXPIRED(asyncStart, SD_TIMEOUT(writeUs)))
+        {
+            SD_histRecord(SD_HIST_BUSY, micros() - asyncStart);
+            SD_STAT_ADD(busyUs, micros() - asyncStart);
+            SD_STAT_INC(timeouts);
+            asyncBusy = false;
+            asyncResult = SD_WRITE_ERROR;
+            return asyncResult;
+        }
+        return SD_BUSY;
+    }
+
+    SD_histRecord(SD_HIST_BUSY, micros() - asyncStart);
+    SD_STAT_ADD(busyUs, micros() - asyncStart);
+
+    // programming finished, check for write errors with CMD13
+    SD_command(CMD13, CMD13_ARG);
+    res1 = SD_readRes1();
+    res2 = SPI.transfer(0xFF);
 
     // deassert chip select
-    SPI.transfer(0xFF);
-    CS_DISABLE();
-    SPI.transfer(0xFF);
+    SD_deselect();
+
+    asyncBusy = false;
+    asyncResult = (res1 == SD_READY && res2 == 0) ? SD_WRITE_SUCCESS : SD_WRITE_ERROR;
+    return asyncResult;
+}
+
+bool SD_isBusy()
+{
+    return SD_poll() == SD_BUSY;
+}
+
+static void SD_waitAsync()
+{
+    // an open write stream keeps the card selected, stop it first
+    SD_parkWriteStream();
+
+    while (SD_poll() == SD_BUSY)
+        ;
+}
+
+sd_ret_t SD_suspend()
+{
+    // the card may lose power once the pending write is programmed; open
+    // streams are stopped and reopened by their next block
+    SD_waitAsync();
+    SD_preempt();
+
+    return asyncResult;
+}
+
+bool SD_setCrcMode(bool enable)
+{
+    // before SD_init() only the setting is kept, SD_init() applies it
+    if (sdBus == BUS_NONE || cardInfo.sectors == 0)
+    {
+        crcMode = enable;
+        return true;
+    }
+
+    // CMD59 must not land in the middle of a transfer
+    SD_waitAsync();
+    SD_parkStream();
+
+    if (SD_crcOnOff(enable) != SD_READY)
+        return false;
+
+    crcMode = enable;
+    return true;
+}
+
+uint8_t SD_readSingleBlock(uint32_t addr, uint8_t *buf, uint8_t *token)
+{
+    uint8_t res1, tries = 0;
+
+    // a previous non-blocking write may still be programming
+    SD_waitAsync();
+
+    do
+    {
+        // set token to none
+        *token = 0xFF;
+
+        // assert chip select
+        if (!SD_select())
+            return 0xFF;
+
+        // send CMD17
+        SD_command(CMD17, SD_ADDR(addr));
+
+        res1 = SD_read_start(buf, SD_BLOCK_LEN, token);
+
+        // deassert chip select
+        SD_deselect();
+
+        // read the block again if the command or the data got corrupted
+    } while ((SD_CMD_CRC_ERR(res1) || (res1 == SD_READY && *token == SD_TOKEN_CRC_BAD)) && SD_crcRetry(&tries));
 
     return res1;
 }
@@ -583,65 +1343,65 @@ uint8_t SD_readSector(uint32_t addr, uint8_t *buf)
     }
 }
 
-uint8_t _writeSingleBlock(uint32_t addr, uint8_t *buf, uint8_t *token)
+uint8_t _writeSingleBlock(uint32_t addr, const uint8_t *buf, uint8_t *token, bool waitBusy)
 {
-    uint8_t writeAttempts, read, res1;
+    uint8_t read, res1, tries = 0;
 
-    // set token to none
-    *token = 0xFF;
+    // a previous non-blocking write may still be programming
+    SD_waitAsync();
 
-    // assert chip select
-    SPI.transfer(0xFF);
-    CS_ENABLE();
-    SPI.transfer(0xFF);
-
-    // send CMD24
-    SD_command(CMD24, addr, CMD24_CRC);
+    do
+    {
+        // set token to none
+        *token = 0xFF;
 
-    // read response
-    res1 = SD_readRes1();
+        // assert chip select
+        if (!SD_select())
+            return 0xFF;
 
-    // if no error
-    if (res1 == SD_READY)
-    {
-        // send start token
-        SPI.transfer(SD_START_TOKEN);
+        // send CMD24
+        SD_command(CMD24, SD_ADDR(addr));
 
-        // write buffer to card
-        for (uint16_t i = 0; i < SD_BLOCK_LEN; i++)
-            SPI.transfer(buf[i]);
-        // wait for a response (timeout = 250ms)
-        writeAttempts = 0;
+        // read response
+        res1 = SD_readRes1();
 
-        while (writeAttempts != SD_MAX_WRITE_ATTEMPTS)
-        {
-            if ((read = SPI.transfer(0xFF)) != 0xFF)
-                break;
-            writeAttempts++;
-        }
-        // if data accepted
-        if ((read & 0x1F) == 0x05)
+        // if no error
+        if (res1 == SD_READY)
         {
-            // set token to data accepted
-            *token = 0x05;
+            // send start token
+            SPI.transfer(SD_START_TOKEN);
+
+            // write buffer and its 16-bit CRC to card
+            SD_sendData(buf, SD_BLOCK_LEN);
 
-            // wait for write to finish (timeout = 250ms)
-            writeAttempts = 0;
-            while (SPI.transfer(0xFF) == 0x00)
+            // wait for a response
+            read = SD_waitResponse(SD_TIMEOUT(writeUs));
+
+            // if data accepted
+            if ((read & 0x1F) == 0x05)
             {
-                if (writeAttempts == SD_MAX_WRITE_ATTEMPTS)
-                {
+                // set token to data accepted
+                *token = 0x05;
+                SD_STAT_INC(sectorsWritten);
+
+                // wait for write to finish
+                if (waitBusy && !SD_waitReady(SD_TIMEOUT(writeUs)))
                     *token = 0x00;
-                    break;
-                }
-                writeAttempts++;
+            }
+            else if ((read & 0x1F) == SD_DATA_CRC_ERR)
+            {
+                *token = SD_DATA_CRC_ERR;
+                SD_STAT_INC(crcErrors);
+
+                // nothing was programmed, the card returns to transfer state
+                SD_waitReady(SD_TIMEOUT(writeUs));
             }
         }
-    }
-    // deassert chip select
-    SPI.transfer(0xFF);
-    CS_DISABLE();
-    SPI.transfer(0xFF);
+        // deassert chip select
+        SD_deselect();
+
+        // send the block again if the command or the data got corrupted
+    } while ((SD_CMD_CRC_ERR(res1) || (res1 == SD_READY && *token == SD_DATA_CRC_ERR)) && SD_crcRetry(&tries));
 
     return res1;
 }
@@ -649,13 +1409,15 @@ uint8_t _writeSingleBlock(uint32_t addr, uint8_t *buf, uint8_t *token)
 uint8_t SD_writeSector(uint32_t addr, uint8_t *buf)
 {
     uint8_t token, res1;
-    res1 = _writeSingleBlock(addr, buf, &token);
+    uint32_t start = micros();
+    res1 = _writeSingleBlock(addr, buf, &token, true);
+    SD_histRecord(SD_HIST_WRITE, micros() - start);
 
     if (res1 == SD_READY)
     {
         if (token == 0x05)
             return SD_WRITE_SUCCESS;
-        else if (token == 0xFF || token == 0x00)
+        else if (token == 0xFF || token == 0x00 || token == SD_DATA_CRC_ERR)
             return SD_WRITE_ERROR;
     }
     else
@@ -665,52 +1427,147 @@ uint8_t SD_writeSector(uint32_t addr, uint8_t *buf)
     }
 }
 
-uint8_t SD_readMultipleSecStart(uint32_t start_addr)
+uint8_t SD_writeSectorAsync(uint32_t addr, const uint8_t *buf)
+{
+    uint8_t token, res1;
+    res1 = _writeSingleBlock(addr, buf, &token, false);
+
+    if (res1 == SD_READY && token == 0x05)
+    {
+        // card is programming; completion is reported by SD_poll()
+        asyncBusy = true;
+        asyncStart = micros();
+        return SD_WRITE_SUCCESS;
+    }
+
+    // SD_printR1(res1);
+    return SD_WRITE_ERROR;
+}
+
+static uint8_t SD_startStream(uint32_t start_addr)
 {
     uint8_t res1;
 
     // assert chip select
-    SPI.transfer(0xFF);
-    CS_ENABLE();
-    SPI.transfer(0xFF);
+    if (!SD_select())
+        return 0xFF;
 
-    // send CMD24
-    SD_command(CMD18, start_addr, CMD18_CRC);
+    // send CMD18
+    SD_command(CMD18, SD_ADDR(start_addr));
 
     // read response
     res1 = SD_readRes1();
 
+    streamOpen = (res1 == SD_READY);
+    streamParked = false;
+    streamNext = start_addr;
+
     return res1;
 }
 
-sd_ret_t SD_readMultipleSec(uint8_t *buff)
+static void SD_stopTransmission()
 {
-    uint8_t read = 0xFF;
-    uint32_t readAttempts;
+    SD_command(CMD12, CMD12_ARG);
 
-    // wait for a response token (timeout = 100ms)
-    readAttempts = 0;
+    // skip stuff byte, then read R1 of CMD12
+    SPI.transfer(0xFF);
+    SD_readRes1();
 
-    while ((read = SPI.transfer(0xFF)) != 0xFE)
-    {
+    // wait while card is busy
+    SD_waitReady(SD_TIMEOUT(writeUs));
 
-        if (readAttempts == SD_MAX_READ_ATTEMPTS)
-            break;
-        readAttempts++;
+    // deassert chip select
+    SD_deselect();
+}
+
+static void SD_parkStream()
+{
+    // chip select must stay asserted during a CMD18 transfer, so the
+    // stream is stopped and reopened instead of just deselected
+    if (!streamOpen || streamParked)
+        return;
+
+    SD_stopTransmission();
+    streamParked = true;
+}
+
+static void SD_preempt()
+{
+    SD_parkStream();
+    SD_parkWriteStream();
+}
+
+void SD_yield()
+{
+    // open streams keep the bus between calls, park them so the work a
+    // higher priority device deferred runs now instead of at their end
+    if (BUS_shouldYield(sdBus))
+        SD_preempt();
+}
+
+uint8_t SD_readMultipleSecStart(uint32_t start_addr)
+{
+    uint8_t res1, tries = 0;
+
+    // a previous non-blocking write may still be programming
+    SD_waitAsync();
+
+    res1 = SD_startStream(start_addr);
+    while (SD_CMD_CRC_ERR(res1) && SD_crcRetry(&tries))
+    {
+        SD_deselect();
+        res1 = SD_startStream(start_addr);
     }
 
+    return res1;
+}
+
+uint8_t _readDataBlock(uint8_t *buff)
+{
+    // wait for a response token
+    uint8_t read = SD_waitToken(SD_TIMEOUT(readUs));
+
     // if response token is 0xFE
     if (read == 0xFE)
     {
-        // read 512 byte block
-        for (uint16_t i = 0; i < 512; i++)
-            buff[i] = SPI.transfer(0xFF);
-
-        // read 16-bit CRC
-        SPI.transfer(0xFF);
-        SPI.transfer(0xFF);
+        // read 512 byte block and its 16-bit CRC
+        if (SD_receiveData(buff, SD_BLOCK_LEN))
+            SD_STAT_INC(sectorsRead);
+        else
+            read = SD_TOKEN_CRC_BAD;
     }
 
+    return read;
+}
+
+sd_ret_t SD_readMultipleSec(uint8_t *buff)
+{
+    uint8_t read, tries = 0;
+
+    // closed, or lost to a failed reopen, SD_readMultipleSecStart() again
+    if (!streamOpen)
+        return SD_READ_ERROR;
+
+    do
+    {
+        // reopen a stream that was stopped for another device
+        if (streamParked)
+        {
+            if (SD_startStream(streamNext) != SD_READY)
+            {
+                // CMD18 was rejected, no transfer to stop, the stream is closed
+                SD_deselect();
+                return SD_READ_ERROR;
+            }
+        }
+
+        read = _readDataBlock(buff);
+
+        // a corrupted block is read again from a stream reopened at it
+        if (read == SD_TOKEN_CRC_BAD)
+            SD_parkStream();
+    } while (read == SD_TOKEN_CRC_BAD && SD_crcRetry(&tries));
+
     if (!(read & 0xF0))
     {
         SD_printDataErrToken(read);
@@ -721,36 +1578,304 @@ sd_ret_t SD_readMultipleSec(uint8_t *buff)
         Serial.print("Read Timeout\r\n");
         return SD_READ_ERROR;
     }
+    streamNext++;
+
+    // a higher priority device is waiting, hand it the bus between blocks
+    if (BUS_shouldYield(sdBus))
+        SD_parkStream();
+
     return SD_READ_SUCCESS;
 }
 
 void SD_readMultipleSecStop()
 {
-    SD_command(CMD12, CMD12_ARG, CMD12_CRC);
+    // a parked stream is already stopped and deselected, a rejected CMD18
+    // only left the card selected
+    if (streamOpen && !streamParked)
+        SD_stopTransmission();
+    else
+        SD_deselect();
 
-    while (SPI.transfer(0xFF) == 0x00)
-        ;
+    streamOpen = false;
+    streamParked = false;
+}
+
+static uint8_t _readMultipleBlock(uint32_t start_addr, uint32_t count, uint8_t *buf, uint8_t *const *bufs, sd_block_err_t *err)
+{
+    uint8_t res1, ret, token = 0xFE, tries = 0;
+    uint32_t block = 0;
+
+    // the one-shot transfer borrows the stream state, a stream of
+    // SD_readMultipleSec() is parked and reopened at its block afterwards
+    bool fgOpen = streamOpen;
+    uint32_t fgNext = streamNext;
+    SD_parkStream();
+
+    res1 = SD_readMultipleSecStart(start_addr);
+
+    while (block < count)
+    {
+        // the command itself got corrupted, issue it again
+        if (res1 != SD_READY)
+        {
+            if (!SD_CMD_CRC_ERR(res1) || !SD_crcRetry(&tries))
+                break;
+            SD_deselect();
+            res1 = SD_startStream(start_addr + block);
+            continue;
+        }
+
+        uint8_t *dst = bufs ? bufs[block] : buf + block * SD_BLOCK_LEN;
+
+        token = _readDataBlock(dst);
+        if (token == 0xFE)
+        {
+            block++;
+            continue;
+        }
+
+        // stop and restart the transfer at the corrupted block
+        if (token != SD_TOKEN_CRC_BAD || !SD_crcRetry(&tries))
+            break;
+        SD_stopTransmission();
+        res1 = SD_startStream(start_addr + block);
+    }
+
+    if (err)
+    {
+        err->res1 = res1;
+        err->block = block;
+        err->token = token;
+    }
+
+    if (res1 != SD_READY)
+    {
+        // deassert chip select
+        SD_deselect();
+        ret = SD_READ_ERROR;
+    }
+    else
+    {
+        SD_readMultipleSecStop();
+
+        // 0xFF is a data token timeout, anything else an error token
+        ret = (token == 0xFE) ? SD_READ_SUCCESS : SD_READ_ERROR;
+    }
+
+    streamOpen = fgOpen;
+    streamParked = fgOpen;
+    streamNext = fgNext;
+    return ret;
+}
+
+uint8_t SD_readSectors(uint32_t start_addr, uint32_t count, uint8_t *buf, sd_block_err_t *err)
+{
+    if (count == 0)
+        return SD_READ_SUCCESS;
+
+    return _readMultipleBlock(start_addr, count, buf, NULL, err);
+}
+
+uint8_t SD_readSectorsScatter(uint32_t start_addr, uint32_t count, uint8_t *const *bufs, sd_block_err_t *err)
+{
+    if (count == 0)
+        return SD_READ_SUCCESS;
+
+    return _readMultipleBlock(start_addr, count, NULL, bufs, err);
+}
+
+static uint32_t SD_auSectors(uint8_t code)
+{
+    // 16KB doubling up to 4MB, then 8, 12, 16, 24, 32 and 64MB
+    static const uint8_t largeAu[] = {8, 12, 16, 24, 32, 64};
+
+    if (code == 0)
+        return 0;
+    if (code <= 9)
+        return 32UL << (code - 1);
+    return (uint32_t)largeAu[code - 10] << 11;
+}
+
+uint8_t SD_readStatus(sd_status_t *status)
+{
+    static const uint8_t speedClasses[] = {0, 2, 4, 6, 10};
+    uint8_t res1, token = 0xFF, reg[SD_STATUS_LEN];
+
+    // a previous non-blocking write may still be programming
+    SD_waitAsync();
+
+    // send app cmd
+    res1 = SD_sendApp();
+    if (res1 > 1)
+        return SD_READ_ERROR;
+
+    // assert chip select
+    if (!SD_select())
+        return SD_READ_ERROR;
+
+    // send ACMD13
+    SD_command(ACMD13, ACMD13_ARG);
+
+    // R2, R1 followed by a status byte
+    res1 = SD_readRes1();
+    if (res1 == SD_READY)
+    {
+        SPI.transfer(0xFF);
+
+        token = SD_waitToken(SD_TIMEOUT(readUs));
+        if (token == SD_START_TOKEN && !SD_receiveData(reg, SD_STATUS_LEN))
+            token = SD_TOKEN_CRC_BAD;
+    }
 
     // deassert chip select
-    SPI.transfer(0xFF);
-    CS_DISABLE();
-    SPI.transfer(0xFF);
+    SD_deselect();
+
+    if (res1 != SD_READY || token != SD_START_TOKEN)
+        return SD_READ_ERROR;
+
+    status->speedClass = (reg[8] < sizeof(speedClasses)) ? speedClasses[reg[8]] : 0;
+    status->uhsGrade = reg[14] >> 4;
+    status->videoClass = reg[15];
+
+    // UHS_AU_SIZE only applies when AU_SIZE is left undefined
+    status->auSectors = SD_auSectors(reg[10] >> 4);
+    if (status->auSectors == 0)
+        status->auSectors = SD_auSectors(reg[14] & 0x0F);
+
+    status->eraseSize = ((uint16_t)reg[11] << 8) | reg[12];
+    status->eraseTimeout = reg[13] >> 2;
+    status->eraseOffset = reg[13] & 0x03;
+
+    return SD_READ_SUCCESS;
+}
+
+sd_status_t SD_getStatus()
+{
+    return cardStatus;
+}
+
+// sectors a single CMD38 is given, eraseSize AUs as the SD Status states
+// its timeout for them, 0 if the card leaves that out
+static uint32_t SD_eraseGroupSectors()
+{
+    if (cardStatus.auSectors == 0 || cardStatus.eraseSize == 0 || cardStatus.eraseTimeout == 0)
+        return 0;
+    return cardStatus.auSectors * cardStatus.eraseSize;
+}
+
+// busy deadline of erasing start_addr..end_addr: eraseTimeout per eraseSize
+// AUs, scaled by the AUs the range touches, plus eraseOffset once
+static uint32_t SD_eraseTimeoutUs(uint32_t start_addr, uint32_t end_addr)
+{
+    if (SD_eraseGroupSectors() == 0)
+        return SD_ERASE_TIMEOUT_US;
+
+    uint32_t aus = end_addr / cardStatus.auSectors - start_addr / cardStatus.auSectors + 1;
+    uint32_t secs = ((uint32_t)cardStatus.eraseTimeout * aus + cardStatus.eraseSize - 1) / cardStatus.eraseSize;
+    return (secs + cardStatus.eraseOffset) * 1000000UL;
+}
+
+uint8_t SD_eraseCommand(uint8_t cmd, uint32_t arg, uint32_t busyUs)
+{
+    // assert chip select
+    if (!SD_select())
+        return 0xFF;
+
+    SD_command(cmd, arg);
+
+    // read response
+    uint8_t res1 = SD_readRes1();
+
+    // CMD38 is R1b, card stays busy until the erase is done
+    if (cmd == CMD38 && res1 == SD_READY && !SD_waitReady(busyUs))
+        res1 = 0xFF;
+
+    // deassert chip select
+    SD_deselect();
+
+    return res1;
+}
+
+uint8_t SD_eraseSectors(uint32_t start_addr, uint32_t end_addr)
+{
+    // a previous non-blocking write may still be programming
+    SD_waitAsync();
+
+    if (!(cardInfo.ccc & CCC_ERASE) || end_addr < start_addr)
+        return SD_ERASE_ERROR;
+
+    // one CMD38 per erase group, so each ends within the deadline of its AUs
+    uint32_t group = SD_eraseGroupSectors();
+    while (true)
+    {
+        uint32_t last = end_addr;
+        if (group != 0 && end_addr - start_addr >= group - start_addr % group)
+            last = start_addr - start_addr % group + group - 1;
+
+        if (SD_eraseCommand(CMD32, SD_ADDR(start_addr), 0) != SD_READY)
+            return SD_ERASE_ERROR;
+
+        if (SD_eraseCommand(CMD33, SD_ADDR(last), 0) != SD_READY)
+            return SD_ERASE_ERROR;
+
+        if (SD_eraseCommand(CMD38, CMD38_ARG, SD_eraseTimeoutUs(start_addr, last)) != SD_READY)
+            return SD_ERASE_ERROR;
+
+        if (last == end_addr)
+            return SD_ERASE_SUCCESS;
+        start_addr = last + 1;
+    }
+}
+
+uint8_t SD_setWrBlkEraseCount(uint32_t blockCnt)
+{
+    uint8_t res1;
+
+    // send app cmd
+    res1 = SD_sendApp();
+    if (res1 > 1)
+        return res1;
+
+    // assert chip select
+    if (!SD_select())
+        return 0xFF;
+
+    // send ACMD23
+    SD_command(ACMD23, blockCnt & ACMD23_MAX_BLOCKS);
+
+    // read response
+    res1 = SD_readRes1();
+
+    // deassert chip select
+    SD_deselect();
+
+    return res1;
 }
 
-uint8_t _writeMultipleBlock(uint32_t start_addr, uint8_t blockCnt, uint8_t *token)
+uint8_t _writeMultipleBlock(uint32_t start_addr, const uint8_t *buf, uint32_t blockCnt, uint8_t *token, uint32_t *written)
 {
-    uint8_t writeAttempts, read, res1;
+    uint8_t read = 0xFF, res1;
+
+    // a previous non-blocking write may still be programming
+    SD_waitAsync();
 
     // set token to none
     *token = 0xFF;
+    *written = 0;
+
+    // let the card pre-erase the blocks, carry on without it if rejected
+    if (preEraseSupported && blockCnt > 1)
+    {
+        if (SD_setWrBlkEraseCount(blockCnt) != SD_READY)
+            preEraseSupported = false;
+    }
 
     // assert chip select
-    SPI.transfer(0xFF);
-    CS_ENABLE();
-    SPI.transfer(0xFF);
+    if (!SD_select())
+        return 0xFF;
 
     // send CMD25
-    SD_command(CMD25, start_addr, CMD25_CRC);
+    SD_command(CMD25, SD_ADDR(start_addr));
 
     // read response
     res1 = SD_readRes1();
@@ -758,85 +1883,387 @@ uint8_t _writeMultipleBlock(uint32_t start_addr, uint8_t blockCnt, uint8_t *toke
     // if no error
     if (res1 == SD_READY)
     {
-        Serial.println("Enter text:");
+        bool rejected = false;
+
         while (blockCnt--)
         {
-            uint8_t write_buff[512] = {0};
-            int i = 0;
-            while (i < 512)
+            // previous block must finish programming before the next token
+            if (*token == 0x05 && !SD_waitReady(SD_TIMEOUT(writeUs)))
             {
-                while (!Serial.available())
-                    ;
-
-                write_buff[i++] = Serial.read();
+                *token = 0x00;
+                break;
             }
 
-            // send start token
-            SPI.transfer(0xFC);
+            // send multiple block start token
+            SPI.transfer(SD_MULTI_START_TOKEN);
+
+            // write buffer and its 16-bit CRC to card
+            SD_sendData(buf, SD_BLOCK_LEN);
+            buf += SD_BLOCK_LEN;
 
-            // write buffer to card
-            for (uint16_t i = 0; i < SD_BLOCK_LEN; i++)
-                SPI.transfer(write_buff[i]);
-            // wait for a response (timeout = 250ms)
-            writeAttempts = 0;
+            // wait for a response
+            read = SD_waitResponse(SD_TIMEOUT(writeUs));
 
-            while (writeAttempts != SD_MAX_WRITE_ATTEMPTS)
+            // if data rejected, stop here
+            if ((read & 0x1F) != 0x05)
             {
-                if ((read = SPI.transfer(0xFF)) != 0xFF)
-                    break;
-                writeAttempts++;
+                *token = 0xFF;
+                if ((read & 0x1F) == SD_DATA_CRC_ERR)
+                {
+                    *token = SD_DATA_CRC_ERR;
+                    SD_STAT_INC(crcErrors);
+                }
+                rejected = true;
+                break;
             }
-            // if data accepted
-            if ((read & 0x1F) == 0x05)
+
+            // set token to data accepted
+            *token = 0x05;
+            (*written)++;
+            SD_STAT_INC(sectorsWritten);
+        }
+
+        if (rejected)
+        {
+            // a write error ends CMD25 with CMD12, not the stop token, once
+            // the card is done with the rejected block
+            SD_waitReady(SD_TIMEOUT(writeUs));
+            if (sdSelected)
+                SD_stopTransmission();
+        }
+        else
+        {
+            // wait for last block, then stop writing
+            if (*token == 0x05 && !SD_waitReady(SD_TIMEOUT(writeUs)))
+                *token = 0x00;
+
+            // a card SD_waitReady() could not select again after a yield
+            // leaves the bus to another device, nothing more is sent
+            if (sdSelected)
             {
-                // set token to data accepted
-                *token = 0x05;
+                SPI.transfer(SD_STOP_TRAN_TOKEN);
+                SPI.transfer(0xFF);
 
-                // wait for write to finish (timeout = 250ms)
-                writeAttempts = 0;
-                while (SPI.transfer(0xFF) == 0x00)
-                {
-                    if (writeAttempts == SD_MAX_WRITE_ATTEMPTS)
-                    {
-                        *token = 0x00;
-                        break;
-                    }
-                    writeAttempts++;
-                }
-                if (writeAttempts < SD_MAX_WRITE_ATTEMPTS)
-                {
-                    Serial.println("Block write success!");
-                }
+                // wait for the card to leave busy state after stop token
+                if (!SD_waitReady(SD_TIMEOUT(writeUs)))
+                    *token = 0x00;
             }
         }
-        // stop writing
-        SPI.transfer(0xFD);
     }
 
     // deassert chip select
+    SD_deselect();
+
+    return res1;
+}
+
+uint8_t SD_writeSectors(uint32_t start_addr, const uint8_t *buf, uint32_t count)
+{
+    uint8_t token, res1, tries = 0;
+    uint32_t written;
+
+    if (count == 0)
+        return SD_WRITE_SUCCESS;
+
+    uint32_t start = micros();
+    for (;;)
+    {
+        res1 = _writeMultipleBlock(start_addr, buf, count, &token, &written);
+
+        // blocks before a corrupted one are programmed, resume at it
+        if (!(SD_CMD_CRC_ERR(res1) || (res1 == SD_READY && token == SD_DATA_CRC_ERR)) || !SD_crcRetry(&tries))
+            break;
+        start_addr += written;
+        buf += written * SD_BLOCK_LEN;
+        count -= written;
+    }
+    SD_histRecord(SD_HIST_WRITE, micros() - start);
+
+    if (res1 == SD_READY && token == 0x05)
+        return SD_WRITE_SUCCESS;
+
+    // SD_printR1(res1);
+    return SD_WRITE_ERROR;
+}
+
+static uint8_t SD_startWriteStream(uint32_t start_addr)
+{
+    uint8_t res1;
+
+    // assert chip select
+    if (!SD_select())
+        return 0xFF;
+
+    // send CMD25
+    SD_command(CMD25, SD_ADDR(start_addr));
+
+    // read response
+    res1 = SD_readRes1();
+
+    wrStreamOpen = (res1 == SD_READY);
+    wrStreamParked = false;
+    wrStreamNext = start_addr;
+
+    // deassert chip select
+    if (!wrStreamOpen)
+        SD_deselect();
+
+    return res1;
+}
+
+static bool SD_stopWriteTransmission()
+{
+    bool done = true;
+
+    // last block must finish programming before the stop token
+    if (!SD_waitReady(SD_TIMEOUT(writeUs)))
+        done = false;
+
+    // lost to another device while busy, see _writeMultipleBlock()
+    if (!sdSelected)
+        return false;
+
+    SPI.transfer(SD_STOP_TRAN_TOKEN);
     SPI.transfer(0xFF);
-    CS_DISABLE();
-    SPI.transfer(0xFF);
+
+    // wait for the card to leave busy state after stop token
+    if (!SD_waitReady(SD_TIMEOUT(writeUs)))
+        done = false;
+
+    // deassert chip select
+    SD_deselect();
+
+    return done;
+}
+
+static void SD_parkWriteStream()
+{
+    // same as a read stream, chip select can't be released mid CMD25
+    if (!wrStreamOpen || wrStreamParked)
+        return;
+
+    SD_stopWriteTransmission();
+    wrStreamParked = true;
+}
+
+uint8_t SD_writeMultipleSecStart(uint32_t start_addr, uint32_t count)
+{
+    uint8_t res1, tries = 0;
+
+    // a previous non-blocking write may still be programming
+    SD_waitAsync();
+
+    // let the card pre-erase the region, carry on without it if rejected
+    if (preEraseSupported && count > 1)
+    {
+        if (SD_setWrBlkEraseCount(count) != SD_READY)
+            preEraseSupported = false;
+    }
+
+    res1 = SD_startWriteStream(start_addr);
+    while (SD_CMD_CRC_ERR(res1) && SD_crcRetry(&tries))
+        res1 = SD_startWriteStream(start_addr);
 
     return res1;
 }
 
-uint8_t SD_writeMultipleBlock(uint32_t start_addr, uint8_t blockCnt)
+sd_ret_t SD_writeMultipleSec(const uint8_t *buf)
 {
+    uint8_t read, tries = 0;
 
-    uint8_t token, res1;
-    res1 = _writeMultipleBlock(start_addr, blockCnt, &token);
+    if (!wrStreamOpen)
+        return SD_WRITE_ERROR;
 
-    if (res1 == SD_READY)
+    do
     {
-        if (token == 0x05)
-            return SD_WRITE_SUCCESS;
-        else if (token == 0xFF || token == 0x00)
+        // reopen a stream that was stopped for another device
+        if (wrStreamParked)
+        {
+            SD_waitAsync();
+            if (SD_startWriteStream(wrStreamNext) != SD_READY)
+            {
+                wrStreamOpen = true;
+                wrStreamParked = true;
+                return SD_WRITE_ERROR;
+            }
+        }
+
+        // previous block must finish programming before the next token,
+        // this is where a slow card pushes back on the caller
+        if (!SD_waitReady(SD_TIMEOUT(writeUs)))
+        {
+            SD_parkWriteStream();
             return SD_WRITE_ERROR;
+        }
+
+        // send multiple block start token
+        SPI.transfer(SD_MULTI_START_TOKEN);
+
+        // write buffer and its 16-bit CRC to card
+        SD_sendData(buf, SD_BLOCK_LEN);
+
+        // wait for a response
+        read = SD_waitResponse(SD_TIMEOUT(writeUs)) & 0x1F;
+
+        // a corrupted block is sent again from a stream reopened at it
+        if (read != 0x05)
+        {
+            if (read == SD_DATA_CRC_ERR)
+                SD_STAT_INC(crcErrors);
+            SD_parkWriteStream();
+        }
+    } while (read == SD_DATA_CRC_ERR && SD_crcRetry(&tries));
+
+    if (read != 0x05)
+        return SD_WRITE_ERROR;
+
+    wrStreamNext++;
+    SD_STAT_INC(sectorsWritten);
+
+    // a higher priority device is waiting, hand it the bus between blocks
+    if (BUS_shouldYield(sdBus))
+        SD_parkWriteStream();
+
+    return SD_WRITE_SUCCESS;
+}
+
+sd_ret_t SD_writeMultipleSecStop()
+{
+    bool done = true;
+
+    // a parked stream is already stopped and deselected
+    if (wrStreamOpen && !wrStreamParked)
+        done = SD_stopWriteTransmission();
+
+    wrStreamOpen = false;
+    wrStreamParked = false;
+
+    return done ? SD_WRITE_SUCCESS : SD_WRITE_ERROR;
+}
+
+void SD_printSectorTiming(uint32_t addr, uint8_t *buf, uint16_t iterations)
+{
+    uint32_t start, readUs, writeUs;
+
+    if (iterations == 0)
+        return;
+
+    // single block read
+    start = micros();
+    for (uint16_t i = 0; i < iterations; i++)
+    {
+        // buf must hold the sector before it is written back, the sector
+        // may well be FAT or directory
+        if (SD_readSector(addr, buf) != SD_READ_SUCCESS)
+        {
+            Serial.println("Read failed, write not timed");
+            return;
+        }
     }
-    else
+    readUs = micros() - start;
+
+    // rewrite the same content, so the sector is left unchanged
+    start = micros();
+    for (uint16_t i = 0; i < iterations; i++)
+        SD_writeSector(addr, buf);
+    writeUs = micros() - start;
+
+    Serial.print("Read: ");
+    Serial.print(readUs / iterations);
+    Serial.print(" us/sector, ");
+    Serial.print((readUs / iterations) * (F_CPU / 1000000UL));
+    Serial.println(" cycles/sector");
+
+    Serial.print("Write: ");
+    Serial.print(writeUs / iterations);
+    Serial.print(" us/sector, ");
+    Serial.print((writeUs / iterations) * (F_CPU / 1000000UL));
+    Serial.println(" cycles/sector");
+}
+
+void SD_setTimeouts(sd_card_type_t type, sd_timeouts_t deadlines)
+{
+    timeouts[type] = deadlines;
+}
+
+void SD_printLatencyHist()
+{
+#if SD_LATENCY_HIST
+    static const char *names[] = {"Read token", "Write", "Busy"};
+
+    for (uint8_t kind = 0; kind < 3; kind++)
     {
-        SD_printR1(res1);
-        return SD_WRITE_ERROR;
+        Serial.print(names[kind]);
+        Serial.println(" latency:");
+        for (uint8_t bucket = 0; bucket < SD_HIST_BUCKETS; bucket++)
+        {
+            if (latencyHist[kind][bucket] == 0)
+                continue;
+            Serial.print("\t>= ");
+            Serial.print(bucket ? (1UL << bucket) : 0UL);
+            Serial.print(" us: ");
+            Serial.println(latencyHist[kind][bucket]);
+        }
     }
+#endif
+}
+
+void SD_resetLatencyHist()
+{
+#if SD_LATENCY_HIST
+    memset(latencyHist, 0, sizeof(latencyHist));
+#endif
+}
+
+sd_stats_t SD_getStats()
+{
+#if SD_STATS
+    return stats;
+#else
+    sd_stats_t none;
+    memset(&none, 0, sizeof(none));
+    return none;
+#endif
+}
+
+void SD_printStats()
+{
+#if SD_STATS
+    Serial.print("CMD17/18/24/25: ");
+    Serial.print(stats.cmd17);
+    Serial.print("/");
+    Serial.print(stats.cmd18);
+    Serial.print("/");
+    Serial.print(stats.cmd24);
+    Serial.print("/");
+    Serial.println(stats.cmd25);
+
+    Serial.print("Sectors read/written: ");
+    Serial.print(stats.sectorsRead);
+    Serial.print("/");
+    Serial.println(stats.sectorsWritten);
+
+    Serial.print("Bytes read/written: ");
+    Serial.print(stats.bytesRead);
+    Serial.print("/");
+    Serial.println(stats.bytesWritten);
+
+    Serial.print("Retries: ");
+    Serial.print(stats.retries);
+    Serial.print(", timeouts: ");
+    Serial.print(stats.timeouts);
+    Serial.print(", CRC errors: ");
+    Serial.println(stats.crcErrors);
+
+    Serial.print("Busy: ");
+    Serial.print(stats.busyUs);
+    Serial.println(" us");
+#endif
+}
+
+void SD_resetStats()
+{
+#if SD_STATS
+    memset(&stats, 0, sizeof(stats));
+#endif
 }
@@ -1,23 +1,127 @@
 #ifndef __SD_DRIVER_H
 #define __SD_DRIVER_H
 typedef enum{
-   SD_READY, SD_INIT_SUCCESS, SD_INIT_ERROR, SD_READ_SUCCESS, SD_READ_ERROR,SD_WRITE_SUCCESS, SD_WRITE_ERROR
+   SD_READY, SD_INIT_SUCCESS, SD_INIT_ERROR, SD_READ_SUCCESS, SD_READ_ERROR,SD_WRITE_SUCCESS, SD_WRITE_ERROR, SD_BUSY, SD_ERASE_SUCCESS, SD_ERASE_ERROR
 }sd_ret_t;
 
+// failure details of a multiple block transfer
+typedef struct{
+   uint8_t res1;   // R1 of the transfer command
+   uint32_t block; // index of the block that failed (== count on success)
+   uint8_t token;  // data token of that block, 0xFF on timeout
+}sd_block_err_t;
+
+typedef enum{
+   SD_CARD_SDSC_V1, SD_CARD_SDSC_V2, SD_CARD_SDHC
+}sd_card_type_t;
+
+typedef struct{
+   sd_card_type_t type;
+   uint32_t ocr;        // OCR register, 0 for version 1 cards
+   uint8_t csdVersion;  // CSD structure version, 1 or 2
+   uint32_t sectors;    // capacity in 512 byte sectors
+   uint16_t blockLen;   // READ_BL_LEN in bytes
+   uint16_t ccc;        // supported card command classes
+   uint32_t tranSpeed;  // TRAN_SPEED in Hz
+   uint32_t clock;      // SPI clock in use in Hz
+}sd_card_info_t;
+
+// command phase deadlines in microseconds
+typedef struct{
+   uint32_t r1Us;    // R1 response
+   uint32_t readUs;  // data token of a read
+   uint32_t writeUs; // data response and busy after a write
+}sd_timeouts_t;
+
+// SD Status register (ACMD13)
+typedef struct{
+   uint8_t speedClass;   // 0, 2, 4, 6 or 10
+   uint8_t uhsGrade;     // UHS speed grade, 0 if none
+   uint8_t videoClass;   // video speed class, 0 if none
+   uint32_t auSectors;   // allocation unit in 512 byte sectors, 0 if not defined
+   uint16_t eraseSize;   // AUs erased within eraseTimeout, 0 if not supported
+   uint8_t eraseTimeout; // seconds
+   uint8_t eraseOffset;  // seconds
+}sd_status_t;
+
+// operation counters, see SD_printStats()
+typedef struct{
+   uint32_t cmd17;          // single block reads issued
+   uint32_t cmd18;          // multiple block reads issued
+   uint32_t cmd24;          // single block writes issued
+   uint32_t cmd25;          // multiple block writes issued
+   uint32_t sectorsRead;
+   uint32_t sectorsWritten;
+   uint32_t bytesRead;      // data phase bytes, sectors and registers
+   uint32_t bytesWritten;
+   uint32_t retries;        // commands re-issued
+   uint32_t timeouts;       // R1, token, data response and busy deadlines missed
+   uint32_t crcErrors;      // data blocks failing their CRC16, either direction
+   uint32_t busyUs;         // time the card spent programming or erasing
+}sd_stats_t;
+
+typedef enum{
+   SD_HIST_READ, SD_HIST_WRITE, SD_HIST_BUSY
+}sd_hist_t;
+
 uint8_t SD_init();
 
+sd_ret_t SD_suspend();
+
+uint8_t SD_resume();
+
+bool SD_setCrcMode(bool enable);
+
+sd_card_info_t SD_getCardInfo();
+
+uint8_t SD_readStatus(sd_status_t *status);
+
+sd_status_t SD_getStatus();
+
 uint8_t SD_readSector(uint32_t SecAddr, uint8_t *buf);
 
 uint8_t SD_writeSector(uint32_t SecAddr, uint8_t* buf);
 
+uint8_t SD_writeSectorAsync(uint32_t SecAddr, const uint8_t *buf);
+
+sd_ret_t SD_poll();
+
+bool SD_isBusy();
+
 uint8_t SD_readMultipleSecStart(uint32_t start_addr);
 
 sd_ret_t SD_readMultipleSec(uint8_t *buff);
 
 void SD_readMultipleSecStop();
 
-void SD_readMultipleSecStop();
+uint8_t SD_readSectors(uint32_t start_addr, uint32_t count, uint8_t *buf, sd_block_err_t *err = NULL);
+
+uint8_t SD_readSectorsScatter(uint32_t start_addr, uint32_t count, uint8_t *const *bufs, sd_block_err_t *err = NULL);
+
+uint8_t SD_writeSectors(uint32_t start_addr, const uint8_t *buf, uint32_t count);
+
+uint8_t SD_writeMultipleSecStart(uint32_t start_addr, uint32_t count);
+
+sd_ret_t SD_writeMultipleSec(const uint8_t *buf);
+
+sd_ret_t SD_writeMultipleSecStop();
+
+void SD_yield();
+
+uint8_t SD_eraseSectors(uint32_t start_addr, uint32_t end_addr);
+
+void SD_printSectorTiming(uint32_t addr, uint8_t *buf, uint16_t iterations);
+
+void SD_setTimeouts(sd_card_type_t type, sd_timeouts_t deadlines);
+
+void SD_printLatencyHist();
+
+void SD_resetLatencyHist();
+
+sd_stats_t SD_getStats();
+
+void SD_printStats();
 
-uint8_t SD_writeMultipleBlock(uint32_t start_addr, uint8_t blockCnt);
+void SD_resetStats();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,189 @@
+#include "SPI.h"
+#include <Arduino.h>
+#include "SPI_bus.h"
+
+// interrupt masking that restores the previous state, so it nests inside ISRs
+#if defined(__AVR__)
+#define BUS_LOCK()          \
+    uint8_t savedSreg = SREG; \
+    cli()
+#define BUS_UNLOCK() SREG = savedSreg
+#elif defined(ESP8266)
+#define BUS_LOCK() uint32_t savedPs = xt_rsil(15)
+#define BUS_UNLOCK() xt_wsr_ps(savedPs)
+#else
+#define BUS_LOCK() noInterrupts()
+#define BUS_UNLOCK() interrupts()
+#endif
+
+typedef struct{
+    uint8_t csPin;
+    uint8_t mode;
+    uint8_t priority;
+    SPISettings settings;
+    bus_deferred_t deferred; // work queued while the bus was held
+    bus_deferred_t preempt;  // asks a parked holder to release the bus
+}bus_device_t;
+
+static bus_device_t devices[BUS_MAX_DEVICES];
+static uint8_t deviceCnt = 0;
+
+static volatile uint8_t owner = BUS_NONE;
+static volatile uint8_t pendingMask = 0;
+static bool draining = false;
+
+uint8_t BUS_register(uint8_t csPin, uint32_t clock, uint8_t mode, uint8_t priority)
+{
+    uint8_t dev;
+
+    // re-initialising a driver keeps its slot
+    for (dev = 0; dev < deviceCnt; dev++)
+    {
+        if (devices[dev].csPin == csPin)
+            break;
+    }
+
+    if (dev == deviceCnt)
+    {
+        if (deviceCnt == BUS_MAX_DEVICES)
+            return BUS_NONE;
+
+        // start the bus with the first device
+        if (deviceCnt == 0)
+            SPI.begin();
+        deviceCnt++;
+    }
+
+    devices[dev].csPin = csPin;
+    devices[dev].mode = mode;
+    devices[dev].priority = priority;
+    devices[dev].settings = SPISettings(clock, MSBFIRST, mode);
+    devices[dev].deferred = NULL;
+    devices[dev].preempt = NULL;
+
+    // deselect right away, a floating chip select corrupts the other devices
+    pinMode(csPin, OUTPUT);
+    digitalWrite(csPin, HIGH);
+
+    return dev;
+}
+
+void BUS_setClock(uint8_t dev, uint32_t clock)
+{
+    // applied by the next BUS_acquire()
+    devices[dev].settings = SPISettings(clock, MSBFIRST, devices[dev].mode);
+}
+
+bool BUS_tryAcquire(uint8_t dev)
+{
+    bool acquired = false;
+
+    BUS_LOCK();
+    if (owner == BUS_NONE)
+    {
+        owner = dev;
+        acquired = true;
+    }
+    BUS_UNLOCK();
+
+    if (acquired)
+        SPI.beginTransaction(devices[dev].settings);
+    return acquired;
+}
+
+bool BUS_acquire(uint8_t dev)
+{
+    if (BUS_tryAcquire(dev))
+        return true;
+
+    // from the main loop a holder can only be a device parked between
+    // calls, ask it to let go; without a hook nothing would ever free it
+    uint8_t holder = owner;
+    if (holder != BUS_NONE && devices[holder].preempt)
+        devices[holder].preempt();
+
+    return BUS_tryAcquire(dev);
+}
+
+static void BUS_runDeferred()
+{
+    // deferred work releases the bus itself, do not recurse
+    if (draining)
+        return;
+    draining = true;
+
+    for (;;)
+    {
+        bus_deferred_t work = NULL;
+
+        BUS_LOCK();
+        if (owner == BUS_NONE && pendingMask)
+        {
+            uint8_t next = BUS_NONE;
+
+            // highest priority first, registration order among equals
+            for (uint8_t dev = 0; dev < deviceCnt; dev++)
+            {
+                if ((pendingMask & (1 << dev)) &&
+                    (next == BUS_NONE || devices[dev].priority > devices[next].priority))
+                    next = dev;
+            }
+            work = devices[next].deferred;
+            devices[next].deferred = NULL;
+            pendingMask &= ~(1 << next);
+        }
+        BUS_UNLOCK();
+
+        if (work == NULL)
+            break;
+        work();
+    }
+
+    draining = false;
+}
+
+void BUS_release(uint8_t dev)
+{
+    // releasing a bus the device does not hold is a no-op
+    if (owner != dev)
+        return;
+
+    SPI.endTransaction();
+    owner = BUS_NONE;
+
+    BUS_runDeferred();
+}
+
+bool BUS_isBusy()
+{
+    return owner != BUS_NONE;
+}
+
+void BUS_defer(uint8_t dev, bus_deferred_t work)
+{
+    BUS_LOCK();
+    devices[dev].deferred = work;
+    pendingMask |= 1 << dev;
+    BUS_UNLOCK();
+
+    // the holder may have released the bus in the meantime
+    if (owner == BUS_NONE)
+        BUS_runDeferred();
+}
+
+bool BUS_shouldYield(uint8_t dev)
+{
+    uint8_t pending = pendingMask;
+
+    for (uint8_t other = 0; other < deviceCnt; other++)
+    {
+        if ((pending & (1 << other)) && devices[other].priority > devices[dev].priority)
+            return true;
+    }
+    return false;
+}
+
+void BUS_setPreempt(uint8_t dev, bus_deferred_t preempt)
+{
+    devices[dev].preempt = preempt;
+}
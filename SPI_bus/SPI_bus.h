@@ -0,0 +1,49 @@
+#ifndef __SPI_BUS_H
+#define __SPI_BUS_H
+
+// Shared SPI bus arbiter. Every device on the bus registers its chip
+// select, clock, mode and priority once and frames each transfer with
+// BUS_acquire()/BUS_release(). Acquire applies the device settings with
+// SPI.beginTransaction(), so devices run at their own clock and mode.
+//
+// Code running in an ISR must not wait for the bus. It checks
+// BUS_tryAcquire() and, if the bus is held, queues its work with
+// BUS_defer(); deferred work runs, highest priority first, as soon as the
+// holder releases the bus. A long holder (e.g. the SD card while it
+// programs a block) polls BUS_shouldYield() and briefly releases the bus
+// so a higher priority device gets in between its blocks.
+//
+// A device may keep the bus between calls (the SD multiple block read
+// stream). It registers a preempt hook with BUS_setPreempt(); BUS_acquire()
+// from the main loop calls it to have the bus handed back. BUS_acquire()
+// fails if the holder has no hook or keeps the bus, waiting would never
+// end. Such a device also polls BUS_shouldYield() between its calls and
+// parks itself, which runs the deferred work.
+
+#define BUS_MAX_DEVICES 4
+#define BUS_NONE 0xFF
+
+#define BUS_PRIO_LOW 0
+#define BUS_PRIO_HIGH 1
+
+typedef void (*bus_deferred_t)(void);
+
+uint8_t BUS_register(uint8_t csPin, uint32_t clock, uint8_t mode, uint8_t priority);
+
+void BUS_setClock(uint8_t dev, uint32_t clock);
+
+bool BUS_acquire(uint8_t dev);
+
+bool BUS_tryAcquire(uint8_t dev);
+
+void BUS_release(uint8_t dev);
+
+bool BUS_isBusy();
+
+void BUS_defer(uint8_t dev, bus_deferred_t work);
+
+bool BUS_shouldYield(uint8_t dev);
+
+void BUS_setPreempt(uint8_t dev, bus_deferred_t preempt);
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef __FAST_PIN_H
+#define __FAST_PIN_H
+
+#include <Arduino.h>
+
+// GPIO without the digitalWrite()/digitalRead() pin table lookups.
+//
+// FastPin<N> resolves pin N to its port register and bit mask at compile
+// time, so on the ATmega328P family a toggle is a single sbi/cbi and on
+// the ESP8266 a single register store. CachedPin does the same lookup
+// once at runtime, for drivers whose pins are constructor arguments.
+// Other targets fall back to the Arduino calls.
+//
+// Configure the pin with pinMode() once; output()/input() then only flip
+// the output driver, which is what an open drain line (I2C) needs.
+
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__) || defined(__AVR_ATmega168__) || defined(__AVR_ATmega168P__)
+#define FAST_PIN_AVR_328
+#endif
+
+template <uint8_t PIN>
+struct FastPin
+{
+#if defined(FAST_PIN_AVR_328)
+    static_assert(PIN < 20, "FastPin: no such pin on the ATmega328P");
+
+    // digital 0-7 on PORTD, 8-13 on PORTB, A0-A5 on PORTC
+    static const uint8_t mask = 1 << (PIN < 8 ? PIN : PIN < 14 ? PIN - 8 : PIN - 14);
+
+    static inline volatile uint8_t &out() { return PIN < 8 ? PORTD : PIN < 14 ? PORTB : PORTC; }
+    static inline volatile uint8_t &ddr() { return PIN < 8 ? DDRD : PIN < 14 ? DDRB : DDRC; }
+    static inline volatile uint8_t &in() { return PIN < 8 ? PIND : PIN < 14 ? PINB : PINC; }
+
+    static inline void high() { out() |= mask; }
+    static inline void low() { out() &= ~mask; }
+    static inline void output() { ddr() |= mask; }
+    static inline void input() { ddr() &= ~mask; }
+    static inline bool read() { return in() & mask; }
+#elif defined(ESP8266)
+    static_assert(PIN < 16, "FastPin: GPIO16 is outside the GPIO register block");
+
+    static inline void high() { GPOS = 1UL << PIN; }
+    static inline void low() { GPOC = 1UL << PIN; }
+    static inline void output() { GPES = 1UL << PIN; }
+    static inline void input() { GPEC = 1UL << PIN; }
+    static inline bool read() { return GPI & (1UL << PIN); }
+#else
+    static inline void high() { digitalWrite(PIN, HIGH); }
+    static inline void low() { digitalWrite(PIN, LOW); }
+    static inline void output() { pinMode(PIN, OUTPUT); }
+    static inline void input() { pinMode(PIN, INPUT); }
+    static inline bool read() { return digitalRead(PIN) == HIGH; }
+#endif
+};
+
+class CachedPin
+{
+public:
+#if defined(__AVR__)
+    void attach(uint8_t pin)
+    {
+        uint8_t port = digitalPinToPort(pin);
+        outReg = portOutputRegister(port);
+        ddrReg = portModeRegister(port);
+        inReg = portInputRegister(port);
+        mask = digitalPinToBitMask(pin);
+    }
+
+    // registers are not constants here, so the read-modify-write must not
+    // race an ISR touching another pin of the same port
+    inline void high()
+    {
+        uint8_t sreg = SREG;
+        cli();
+        *outReg |= mask;
+        SREG = sreg;
+    }
+    inline void low()
+    {
+        uint8_t sreg = SREG;
+        cli();
+        *outReg &= ~mask;
+        SREG = sreg;
+    }
+    inline void output()
+    {
+        uint8_t sreg = SREG;
+        cli();
+        *ddrReg |= mask;
+        SREG = sreg;
+    }
+    inline void input()
+    {
+        uint8_t sreg = SREG;
+        cli();
+        *ddrReg &= ~mask;
+        SREG = sreg;
+    }
+    inline bool read() { return *inReg & mask; }
+
+private:
+    volatile uint8_t *outReg;
+    volatile uint8_t *ddrReg;
+    volatile uint8_t *inReg;
+    uint8_t mask;
+#elif defined(ESP8266)
+    void attach(uint8_t pin)
+    {
+        this->pin = pin;
+        mask = (pin < 16) ? (1UL << pin) : 0;
+    }
+
+    // set/clear registers need no read-modify-write, GPIO16 goes the slow way
+    inline void high()
+    {
+        if (mask)
+            GPOS = mask;
+        else
+            digitalWrite(pin, HIGH);
+    }
+    inline void low()
+    {
+        if (mask)
+            GPOC = mask;
+        else
+            digitalWrite(pin, LOW);
+    }
+    inline void output()
+    {
+        if (mask)
+            GPES = mask;
+        else
+            pinMode(pin, OUTPUT);
+    }
+    inline void input()
+    {
+        if (mask)
+            GPEC = mask;
+        else
+            pinMode(pin, INPUT);
+    }
+    inline bool read() { return mask ? (GPI & mask) != 0 : digitalRead(pin) == HIGH; }
+
+private:
+    uint8_t pin;
+    uint32_t mask;
+#else
+    void attach(uint8_t pin) { this->pin = pin; }
+
+    inline void high() { digitalWrite(pin, HIGH); }
+    inline void low() { digitalWrite(pin, LOW); }
+    inline void output() { pinMode(pin, OUTPUT); }
+    inline void input() { pinMode(pin, INPUT); }
+    inline bool read() { return digitalRead(pin) == HIGH; }
+
+private:
+    uint8_t pin;
+#endif
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include <string.h>
+#include "blockDevice.h"
+
+bool BlockDevice::init()
+{
+    streaming = false;
+    writeStreaming = false;
+    return begin();
+}
+
+bool BlockDevice::readSector(uint32_t sector, uint8_t *buf)
+{
+    return readSectors(sector, buf, 1);
+}
+
+bool BlockDevice::readSectors(uint32_t sector, uint8_t *buf, uint32_t count)
+{
+    devStats.readCmds++;
+    devStats.sectorsRead += count;
+    return readBlocks(sector, buf, count);
+}
+
+bool BlockDevice::writeSector(uint32_t sector, const uint8_t *buf)
+{
+    return writeSectors(sector, buf, 1);
+}
+
+bool BlockDevice::writeSectors(uint32_t sector, const uint8_t *buf, uint32_t count)
+{
+    devStats.writeCmds++;
+    devStats.sectorsWritten += count;
+    return writeBlocks(sector, buf, count);
+}
+
+bool BlockDevice::eraseSectors(uint32_t sector, uint32_t count)
+{
+    devStats.eraseCmds++;
+    devStats.sectorsErased += count;
+    return eraseBlocks(sector, count);
+}
+
+bool BlockDevice::readStart(uint32_t sector)
+{
+    devStats.readCmds++;
+    if (!streamStart(sector))
+        return false;
+    streaming = true;
+    return true;
+}
+
+bool BlockDevice::readNext(uint8_t *buf)
+{
+    devStats.sectorsRead++;
+    return streamRead(buf);
+}
+
+void BlockDevice::readStop()
+{
+    // nothing to stop unless a stream is open
+    if (!streaming)
+        return;
+    streamStop();
+    streaming = false;
+}
+
+bool BlockDevice::writeStart(uint32_t sector, uint32_t count)
+{
+    devStats.writeCmds++;
+    if (!writeStreamStart(sector, count))
+        return false;
+    writeStreaming = true;
+    return true;
+}
+
+bool BlockDevice::writeNext(const uint8_t *buf)
+{
+    devStats.sectorsWritten++;
+    return writeStreamWrite(buf);
+}
+
+bool BlockDevice::writeStop()
+{
+    // nothing to stop unless a stream is open
+    if (!writeStreaming)
+        return true;
+    writeStreaming = false;
+    return writeStreamStop();
+}
+
+void BlockDevice::resetStats()
+{
+    memset(&devStats, 0, sizeof(devStats));
+}
+
+bool BlockDevice::streamStart(uint32_t sector)
+{
+    streamSector = sector;
+    return true;
+}
+
+bool BlockDevice::streamRead(uint8_t *buf)
+{
+    return readBlocks(streamSector++, buf, 1);
+}
+
+void BlockDevice::streamStop()
+{
+}
+
+bool BlockDevice::writeStreamStart(uint32_t sector, uint32_t count)
+{
+    writeStreamSector = sector;
+    return true;
+}
+
+bool BlockDevice::writeStreamWrite(const uint8_t *buf)
+{
+    return writeBlocks(writeStreamSector++, buf, 1);
+}
+
+bool BlockDevice::writeStreamStop()
+{
+    return true;
+}
+
+bool RamBlockDevice::readBlocks(uint32_t sector, uint8_t *buf, uint32_t count)
+{
+    if (sector + count > ramSectors)
+        return false;
+    memcpy(buf, ramMem + sector * 512, count * 512);
+    return true;
+}
+
+bool RamBlockDevice::writeBlocks(uint32_t sector, const uint8_t *buf, uint32_t count)
+{
+    if (sector + count > ramSectors)
+        return false;
+    memcpy(ramMem + sector * 512, buf, count * 512);
+    return true;
+}
+
+bool RamBlockDevice::eraseBlocks(uint32_t sector, uint32_t count)
+{
+    if (sector + count > ramSectors)
+        return false;
+    memset(ramMem + sector * 512, 0, count * 512);
+    return true;
+}
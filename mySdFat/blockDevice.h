@@ -0,0 +1,167 @@
+#ifndef __BLOCKDEVICE_H
+#define __BLOCKDEVICE_H
+
+#include <stdint.h>
+
+typedef struct
+{
+    uint32_t readCmds;
+    uint32_t writeCmds;
+    uint32_t sectorsRead;
+    uint32_t sectorsWritten;
+    uint32_t eraseCmds;
+    uint32_t sectorsErased;
+} blockDevStats_t;
+
+/**
+ * @brief 512 byte sector device the filesystem runs on.
+ *
+ * Backends implement the protected primitives; the public calls count
+ * every operation so sector I/O per filesystem call can be measured.
+ */
+class BlockDevice
+{
+public:
+    virtual ~BlockDevice() {}
+
+    bool init();
+    bool readSector(uint32_t sector, uint8_t *buf);
+    bool readSectors(uint32_t sector, uint8_t *buf, uint32_t count);
+    bool writeSector(uint32_t sector, const uint8_t *buf);
+    bool writeSectors(uint32_t sector, const uint8_t *buf, uint32_t count);
+
+    // tell the device a range no longer holds data
+    bool eraseSectors(uint32_t sector, uint32_t count);
+
+    // power the device down and back up, sector contents are kept
+    bool suspend() { return sleepDevice(); }
+    bool resume() { return wakeDevice(); }
+
+    // sequential read of consecutive sectors
+    bool readStart(uint32_t sector);
+    bool readNext(uint8_t *buf);
+    void readStop();
+
+    // sequential write of count consecutive sectors, the device may still
+    // be programming the last one when writeNext() returns
+    bool writeStart(uint32_t sector, uint32_t count);
+    bool writeNext(const uint8_t *buf);
+    bool writeStop();
+
+    // between stream calls, a device on a shared bus may hand it over
+    void idle() { streamIdle(); }
+
+    virtual uint32_t sectorCount() = 0;
+
+    // erase/programming unit writes should be aligned to, 0 if unknown
+    virtual uint32_t allocUnitSectors() { return 0; }
+
+    blockDevStats_t stats() { return devStats; }
+    void resetStats();
+
+protected:
+    virtual bool begin() = 0;
+    virtual bool readBlocks(uint32_t sector, uint8_t *buf, uint32_t count) = 0;
+    virtual bool writeBlocks(uint32_t sector, const uint8_t *buf, uint32_t count) = 0;
+
+    // erase is advisory, backends without it ignore the request
+    virtual bool eraseBlocks(uint32_t sector, uint32_t count) { return true; }
+
+    // backends without a power state have nothing to do
+    virtual bool sleepDevice() { return true; }
+    virtual bool wakeDevice() { return true; }
+
+    // default stream reads one sector at a time with readBlocks()
+    virtual bool streamStart(uint32_t sector);
+    virtual bool streamRead(uint8_t *buf);
+    virtual void streamStop();
+
+    // default write stream writes one sector at a time with writeBlocks()
+    virtual bool writeStreamStart(uint32_t sector, uint32_t count);
+    virtual bool writeStreamWrite(const uint8_t *buf);
+    virtual bool writeStreamStop();
+
+    // backends with a bus of their own have nothing to hand over
+    virtual void streamIdle() {}
+
+    bool streaming = false;
+    uint32_t streamSector = 0;
+    bool writeStreaming = false;
+    uint32_t writeStreamSector = 0;
+
+private:
+    blockDevStats_t devStats = {0, 0, 0, 0, 0, 0};
+};
+
+#if defined(ARDUINO)
+// SD card on the SPI bus through SD_driver
+class SdSpiBlockDevice : public BlockDevice
+{
+public:
+    uint32_t sectorCount();
+    uint32_t allocUnitSectors();
+
+protected:
+    bool begin();
+    bool readBlocks(uint32_t sector, uint8_t *buf, uint32_t count);
+    bool writeBlocks(uint32_t sector, const uint8_t *buf, uint32_t count);
+    bool eraseBlocks(uint32_t sector, uint32_t count);
+    bool sleepDevice();
+    bool wakeDevice();
+    bool streamStart(uint32_t sector);
+    bool streamRead(uint8_t *buf);
+    void streamStop();
+    bool writeStreamStart(uint32_t sector, uint32_t count);
+    bool writeStreamWrite(const uint8_t *buf);
+    bool writeStreamStop();
+    void streamIdle();
+};
+#endif
+
+// volume held in caller provided memory
+class RamBlockDevice : public BlockDevice
+{
+public:
+    RamBlockDevice(uint8_t *mem, uint32_t sectors)
+    {
+        ramMem = mem;
+        ramSectors = sectors;
+    }
+    uint32_t sectorCount() { return ramSectors; }
+
+protected:
+    bool begin() { return ramMem != 0; }
+    bool readBlocks(uint32_t sector, uint8_t *buf, uint32_t count);
+    bool writeBlocks(uint32_t sector, const uint8_t *buf, uint32_t count);
+    bool eraseBlocks(uint32_t sector, uint32_t count);
+
+private:
+    uint8_t *ramMem;
+    uint32_t ramSectors;
+};
+
+#if defined(__linux__) && !defined(ARDUINO)
+// FAT image file on a workstation, for host side benchmarking
+class FileBlockDevice : public BlockDevice
+{
+public:
+    FileBlockDevice(const char *path)
+    {
+        imgPath = path;
+        fd = -1;
+    }
+    ~FileBlockDevice();
+    uint32_t sectorCount();
+
+protected:
+    bool begin();
+    bool readBlocks(uint32_t sector, uint8_t *buf, uint32_t count);
+    bool writeBlocks(uint32_t sector, const uint8_t *buf, uint32_t count);
+
+private:
+    const char *imgPath;
+    int fd;
+};
+#endif
+
+#endif
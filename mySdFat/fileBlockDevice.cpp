@@ -0,0 +1,41 @@
+#if defined(__linux__) && !defined(ARDUINO)
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "blockDevice.h"
+
+FileBlockDevice::~FileBlockDevice()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+bool FileBlockDevice::begin()
+{
+    if (fd < 0)
+        fd = open(imgPath, O_RDWR);
+    return fd >= 0;
+}
+
+uint32_t FileBlockDevice::sectorCount()
+{
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0)
+        return 0;
+    return st.st_size / 512;
+}
+
+bool FileBlockDevice::readBlocks(uint32_t sector, uint8_t *buf, uint32_t count)
+{
+    ssize_t len = (ssize_t)count * 512;
+    return pread(fd, buf, len, (off_t)sector * 512) == len;
+}
+
+bool FileBlockDevice::writeBlocks(uint32_t sector, const uint8_t *buf, uint32_t count)
+{
+    ssize_t len = (ssize_t)count * 512;
+    return pwrite(fd, buf, len, (off_t)sector * 512) == len;
+}
+#endif
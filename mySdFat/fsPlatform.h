@@ -0,0 +1,46 @@
+#ifndef __FSPLATFORM_H
+#define __FSPLATFORM_H
+
+// What the filesystem takes from the Arduino core: the Serial console and
+// micros(). Host builds (tests, image tools) get both from the C library.
+#if defined(ARDUINO)
+#include <Arduino.h>
+#else
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+static inline unsigned long micros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief The print()/println() calls of the library, written to stdout
+ */
+class HostSerial
+{
+public:
+    void print(const char *s) { fputs(s, stdout); }
+    void print(char c) { putchar(c); }
+    void print(int v) { printf("%d", v); }
+    void print(unsigned int v) { printf("%u", v); }
+    void print(long v) { printf("%ld", v); }
+    void print(unsigned long v) { printf("%lu", v); }
+    void print(double v) { printf("%.2f", v); }
+
+    void println() { putchar('\n'); }
+    template <typename T>
+    void println(T v)
+    {
+        print(v);
+        println();
+    }
+};
+
+static HostSerial Serial;
+#endif
+
+#endif
@@ -1,15 +1,28 @@
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
-#include <Arduino.h>
-#include <SPI.h>
+#include "fsPlatform.h"
 #include "SD_driver.h"
 #include "mySdFat.h"
+#if defined(ARDUINO)
 #include "myOled.h"
+#endif
 
 
 bootSecParams_t params;
 uint8_t SD_buff[512];
 
+#if defined(ARDUINO)
+static SdSpiBlockDevice sdSpiDev;
+static BlockDevice *blockDev = &sdSpiDev;
+#else
+static BlockDevice *blockDev = NULL;
+#endif
+
+// boot sector of the volume, 0 on a card formatted without a partition table
+uint32_t VolStartSector;
+uint32_t FSInfoSector;
+
 uint32_t FatStartSector;
 uint32_t FatSectorsCnt;
 
@@ -21,6 +34,146 @@ uint32_t DataSectorsCnt;
 
 char fileName[128] = "";
 uint8_t fileNameIndex;
+
+static bool eraseOnDelete = false;
+
+// allocation unit in clusters and the first cluster starting one, 0 if unknown
+static uint32_t auClusters = 0;
+static uint32_t auFirstClus = 0;
+
+// free space map in caller memory, see mySdFat_buildFreeMap(); a bit per
+// cluster (set when free) or a free count per group of FAT sectors
+static uint8_t *freeBits = NULL;
+static uint16_t *freeCounts = NULL;
+static uint16_t freeGroupSecs;
+
+/**
+ * @brief  Last cluster that can be allocated, bounded by what the FAT can hold
+ *
+ * @return cluster index
+ */
+static uint32_t lastCluster()
+{
+    uint32_t lastClus = DataSectorsCnt / params.BPB_SecPerClus + 1;
+    uint32_t fatEnts = params.BPB_FATSz32 * (params.BPB_BytesPerSec / 4);
+    return (lastClus < fatEnts) ? lastClus : fatEnts - 1;
+}
+
+/**
+ * @brief  Keep the free space map in step with a FAT entry that changed
+ *
+ * @param[in] clus cluster whose entry changed
+ * @param[in] isFree true if it was just freed, false if just taken
+ */
+static void freeMapNote(uint32_t clus, bool isFree)
+{
+    if (freeBits != NULL)
+    {
+        uint8_t mask = 1 << ((clus - 2) & 7);
+        if (isFree)
+            freeBits[(clus - 2) >> 3] |= mask;
+        else
+            freeBits[(clus - 2) >> 3] &= ~mask;
+    }
+    else if (freeCounts != NULL)
+    {
+        uint16_t *cnt = &freeCounts[clus / 128 / freeGroupSecs];
+        if (isFree)
+            (*cnt)++;
+        else
+            (*cnt)--;
+    }
+}
+
+#if MYSDFAT_STATS
+static fsApiStats_t apiStats[FS_API_CNT];
+static uint8_t apiDepth = 0;
+
+/**
+ * @brief Charges the sector I/O done while in scope to a public call.
+ *
+ * Public calls made from inside another one (nextFile() while fileOpen()
+ * walks the path) count towards the outer call only.
+ */
+class ApiStatScope
+{
+public:
+    ApiStatScope(fsApi_t api)
+    {
+        this->api = api;
+        if (apiDepth++ == 0)
+        {
+            start = blockDev->stats();
+            startUs = micros();
+        }
+    }
+
+    ~ApiStatScope()
+    {
+        if (--apiDepth != 0)
+            return;
+
+        blockDevStats_t now = blockDev->stats();
+        apiStats[api].calls++;
+        apiStats[api].readCmds += now.readCmds - start.readCmds;
+        apiStats[api].writeCmds += now.writeCmds - start.writeCmds;
+        apiStats[api].sectorsRead += now.sectorsRead - start.sectorsRead;
+        apiStats[api].sectorsWritten += now.sectorsWritten - start.sectorsWritten;
+        apiStats[api].us += micros() - startUs;
+    }
+
+private:
+    fsApi_t api;
+    blockDevStats_t start;
+    uint32_t startUs;
+};
+#define API_STATS(API) ApiStatScope apiStatScope(API)
+#else
+#define API_STATS(API)
+#endif
+/**
+ * @brief  Check for a FAT boot sector in SD_buff
+ * @return true/false
+ */
+static bool isBootSector()
+{
+    uint16_t bytesPerSec = (uint16_t)SD_buff[11] | ((uint16_t)SD_buff[12] << 8);
+    uint8_t secPerClus = SD_buff[13];
+
+    return (SD_buff[0] == 0xEB || SD_buff[0] == 0xE9) && bytesPerSec == 512 &&
+           secPerClus != 0 && (secPerClus & (secPerClus - 1)) == 0 && SD_buff[16] != 0;
+}
+
+/**
+ * @brief  Find the boot sector of the volume, behind the first partition of
+ *         the MBR or in sector 0 of a card formatted without one
+ *
+ * @param[out] bootSec sector of the boot sector
+ * @return true/false
+ */
+static bool findBootSector(uint32_t *bootSec)
+{
+    if (!blockDev->readSector(0, SD_buff) || SD_buff[510] != 0x55 || SD_buff[511] != 0xAA)
+        return false;
+
+    if (isBootSector())
+    {
+        *bootSec = 0;
+        return true;
+    }
+
+    // first partition entry, starting LBA at offset 8
+    uint8_t *part = &SD_buff[446];
+    if (part[4] == 0x00)
+        return false;
+    *bootSec = ((uint32_t)part[8]);
+    *bootSec |= ((uint32_t)part[9]) << 8;
+    *bootSec |= ((uint32_t)part[10]) << 16;
+    *bootSec |= ((uint32_t)part[11]) << 24;
+
+    return *bootSec != 0 && blockDev->readSector(*bootSec, SD_buff) && isBootSector();
+}
+
 /**
  * @brief Get the Boot Sectore params
  * @return true
@@ -28,7 +181,7 @@ uint8_t fileNameIndex;
  */
 static bool getBootSecParams()
 {
-    if (SD_readSector(BOOT_SEC_START, SD_buff) == SD_READ_SUCCESS)
+    if (findBootSector(&VolStartSector))
     {
 
         params.BPB_BytesPerSec = (uint16_t)SD_buff[11];
@@ -114,8 +267,10 @@ static uint32_t fatNextClus(uint32_t fatThisClus)
 {
     uint32_t temp;
     fatEntLoc_t fatEntLoc = fatEntLocation(fatThisClus);
-    SD_readSector(fatEntLoc.fatSecNum, SD_buff);
-    temp = *((uint32_t *)&SD_buff[fatEntLoc.fatEntOffset]);
+    uint8_t *buf = fatCacheRead(fatEntLoc.fatSecNum);
+    if (buf == NULL)
+        return 0x0FFFFFFF;
+    memcpy(&temp, &buf[fatEntLoc.fatEntOffset], 4);
 
     return temp;
 }
@@ -124,10 +279,93 @@ static void fatSetNextClus(uint32_t fatThisClus, uint32_t fatNextClus)
 {
     uint32_t *p_temp;
     fatEntLoc_t fatEntLoc = fatEntLocation(fatThisClus);
-    SD_readSector(fatEntLoc.fatSecNum, SD_buff);
-    p_temp = ((uint32_t *)&SD_buff[fatEntLoc.fatEntOffset]);
+    uint8_t *buf = fatCacheWrite(fatEntLoc.fatSecNum);
+    if (buf == NULL)
+        return;
+    p_temp = ((uint32_t *)&buf[fatEntLoc.fatEntOffset]);
+
+    uint32_t prev;
+    memcpy(&prev, p_temp, 4);
+    if ((prev == 0) != (fatNextClus == 0))
+        freeMapNote(fatThisClus, fatNextClus == 0);
+
     memcpy(p_temp, &fatNextClus, 4);
-    SD_writeSector(fatEntLoc.fatSecNum, SD_buff);
+}
+
+/**
+ * @brief  Chain a run of free clusters in order and end it, filling each
+ *         FAT sector through a single cache lookup
+ *
+ * @param[in] firstClus first cluster of the run
+ * @param[in] clusCnt number of clusters
+ */
+static void fatLinkRun(uint32_t firstClus, uint32_t clusCnt)
+{
+    uint32_t entsPerSec = params.BPB_BytesPerSec / 4;
+    uint32_t clus = firstClus;
+    uint32_t endClus = firstClus + clusCnt;
+
+    while (clus < endClus)
+    {
+        fatEntLoc_t fatEntLoc = fatEntLocation(clus);
+        uint8_t *buf = fatCacheWrite(fatEntLoc.fatSecNum);
+        if (buf == NULL)
+            return;
+
+        // entries up to the end of this sector or of the run
+        uint32_t secEnd = (clus / entsPerSec + 1) * entsPerSec;
+        if (secEnd > endClus)
+            secEnd = endClus;
+
+        for (uint8_t *ent = buf + fatEntLoc.fatEntOffset; clus < secEnd; clus++, ent += 4)
+        {
+            uint32_t next = (clus + 1 == endClus) ? FAT_EOC : clus + 1;
+            freeMapNote(clus, false);
+            memcpy(ent, &next, 4);
+        }
+    }
+}
+
+/**
+ * @brief  Check a cluster is free, from the bitmap when there is one
+ *
+ * @param[in] clus cluster index
+ * @return true if free
+ */
+static bool clusIsFree(uint32_t clus)
+{
+    if (freeBits != NULL)
+        return freeBits[(clus - 2) >> 3] & (1 << ((clus - 2) & 7));
+    return fatNextClus(clus) == 0;
+}
+
+/**
+ * @brief  Skip clusters the free space map rules out
+ *
+ * @param[in] clus cluster to start from
+ * @param[in] lastClus last cluster of the volume
+ * @return first cluster at or after clus that may be free, lastClus + 1 if none
+ */
+static uint32_t freeMapSkip(uint32_t clus, uint32_t lastClus)
+{
+    if (freeBits != NULL)
+    {
+        // whole bytes of used clusters at a time
+        while (clus <= lastClus && !clusIsFree(clus))
+        {
+            if (((clus - 2) & 7) == 0 && freeBits[(clus - 2) >> 3] == 0)
+                clus += 8;
+            else
+                clus++;
+        }
+    }
+    else if (freeCounts != NULL)
+    {
+        uint32_t groupClus = (uint32_t)freeGroupSecs * 128;
+        while (clus <= lastClus && freeCounts[clus / groupClus] == 0)
+            clus = (clus / groupClus + 1) * groupClus;
+    }
+    return (clus <= lastClus) ? clus : lastClus + 1;
 }
 
 static uint32_t startSecOfClus(uint32_t cluster_index)
@@ -135,6 +373,115 @@ static uint32_t startSecOfClus(uint32_t cluster_index)
     return (DataStartSector + (cluster_index - 2) * params.BPB_SecPerClus);
 }
 
+/**
+ * @brief  Resolve the physically contiguous run of a cluster chain ahead of streaming
+ *
+ * @param[in] startClus first cluster of the run
+ * @param[out] nextClus cluster following the run (FAT_EOC or above at end of chain)
+ * @return number of clusters in the run
+ */
+static uint32_t fatContigRun(uint32_t startClus, uint32_t *nextClus)
+{
+    uint32_t runLen = 1;
+    uint32_t clus = startClus;
+
+    while ((*nextClus = fatNextClus(clus)) == clus + 1 && runLen < READ_AHEAD_MAX_CLUS)
+    {
+        clus++;
+        runLen++;
+    }
+    return runLen;
+}
+
+/**
+ * @brief  Erase the data sectors of a run of freed clusters
+ *
+ * @param[in] startClus first cluster of the run
+ * @param[in] clusCnt number of clusters, 0 does nothing
+ */
+static void eraseClusRun(uint32_t startClus, uint32_t clusCnt)
+{
+    if (clusCnt == 0)
+        return;
+    blockDev->eraseSectors(startSecOfClus(startClus), clusCnt * params.BPB_SecPerClus);
+}
+
+/**
+ * @brief  Map a cluster index of a file to its cluster through its extents
+ *
+ * Runs are read from the FAT on demand and kept as a window that only
+ * slides forward, so sequential access and appends don't walk the chain
+ * from its start again.
+ *
+ * @param[in] pFile file
+ * @param[in] clusIdx cluster index from the start of the file
+ * @param[out] runLeft clusters from this one to the end of its run, at most
+ *             READ_AHEAD_MAX_CLUS, may be NULL
+ * @return cluster, FAT_EOC or above past the end of the chain
+ */
+static uint32_t fileClusAt(myFile *pFile, uint32_t clusIdx, uint32_t *runLeft)
+{
+    fileExtents_t *ext = &pFile->extents;
+
+    // start over in front of the window
+    if (ext->cnt == 0 || clusIdx < ext->run[0].fileClus)
+    {
+        ext->run[0].fileClus = 0;
+        ext->run[0].firstClus = startCluster(pFile);
+        ext->run[0].clusCnt = 1;
+        ext->cnt = 1;
+    }
+
+    while (1)
+    {
+        for (uint8_t i = ext->cnt; i-- > 0;)
+        {
+            fileExtent_t *run = &ext->run[i];
+            if (clusIdx >= run->fileClus && clusIdx - run->fileClus < run->clusCnt)
+            {
+                // the last run may go on further than seen so far
+                if (runLeft != NULL && i == ext->cnt - 1)
+                {
+                    uint32_t tailClus = run->firstClus + run->clusCnt - 1;
+                    while (run->clusCnt - (clusIdx - run->fileClus) < READ_AHEAD_MAX_CLUS && fatNextClus(tailClus) == tailClus + 1)
+                    {
+                        run->clusCnt++;
+                        tailClus++;
+                    }
+                }
+
+                if (runLeft != NULL)
+                    *runLeft = run->clusCnt - (clusIdx - run->fileClus);
+                return run->firstClus + (clusIdx - run->fileClus);
+            }
+        }
+
+        // extend the last run or start a new one behind it
+        fileExtent_t last = ext->run[ext->cnt - 1];
+        uint32_t tailClus = last.firstClus + last.clusCnt - 1;
+        uint32_t nextClus = fatNextClus(tailClus);
+
+        if (nextClus < 2 || nextClus >= FAT_EOC)
+            return FAT_EOC;
+
+        if (nextClus == tailClus + 1)
+        {
+            ext->run[ext->cnt - 1].clusCnt++;
+            continue;
+        }
+
+        if (ext->cnt == FILE_EXTENTS)
+        {
+            memmove(&ext->run[0], &ext->run[1], (FILE_EXTENTS - 1) * sizeof(fileExtent_t));
+            ext->cnt--;
+        }
+        fileExtent_t *run = &ext->run[ext->cnt++];
+        run->fileClus = last.fileClus + last.clusCnt;
+        run->firstClus = nextClus;
+        run->clusCnt = 1;
+    }
+}
+
 static void displayTime(uint16_t time)
 {
     uint8_t hours = (time & 0xF800) >> 11;
@@ -212,10 +559,26 @@ static bool LFN_Entry(myFile *pFile)
     return (((pFile->DIR_attr & ATTR_LONG_NAME_MASK) == ATTR_LONG_FILE_NAME) && (((uint8_t)pFile->DIR_Name[0] & 0xF0) == 0x40));
 }
 
+/**
+ * @brief  Copy a directory entry into a file object with no position and
+ *         no extents yet
+ *
+ * @param[in] ent 32 byte directory entry
+ * @return file object
+ */
+static myFile dirEntry(const uint8_t *ent)
+{
+    myFile entry = {0};
+    memcpy(&entry, ent, 32);
+    return entry;
+}
+
 myFile rootDir()
 {
-    SD_readSector(startSecOfClus(params.BPB_RootClus), SD_buff);
-    myFile rootDir = *((myFile *)&SD_buff[0]);
+    myFile rootDir = {0};
+    uint8_t *buf = cacheRead(startSecOfClus(params.BPB_RootClus));
+    if (buf != NULL)
+        rootDir = dirEntry(&buf[0]);
     rootDir.DIR_FstClusLO = 2;
     rootDir.entryIndex = 1;
 
@@ -229,21 +592,19 @@ myFile rootDir()
  */
 myFile nextFile(myFile *pFolder)
 {
+    API_STATS(FS_API_NEXT_FILE);
     uint8_t sectorIndex = (pFolder->entryIndex / 16) % params.BPB_SecPerClus;
     uint32_t currentClus = startCluster(pFolder);
     myFile temp = {0};
 
     uint32_t currentClusterIndex = (pFolder->entryIndex / (16 * params.BPB_SecPerClus));
 
-    for (uint8_t i = 0; i < currentClusterIndex; i++)
+    currentClus = fileClusAt(pFolder, currentClusterIndex, NULL);
+    if (currentClus >= FAT_EOC)
     {
-        currentClus = fatNextClus(currentClus);
-        if (currentClus >= FAT_EOC)
-        {
-            pFolder->entryIndex = 2;
-            temp = {0};
-            return temp;
-        }
+        pFolder->entryIndex = 2;
+        temp = {0};
+        return temp;
     }
 
     if (pFolder->entryIndex <= 2)
@@ -259,12 +620,17 @@ myFile nextFile(myFile *pFolder)
         return temp;
     }
 
-    SD_readSector(startSecOfClus(currentClus) + sectorIndex, SD_buff);
+    uint8_t *buf = cacheRead(startSecOfClus(currentClus) + sectorIndex);
 
     while (1)
     {
+        if (buf == NULL)
+        {
+            temp = {0};
+            return temp;
+        }
 
-        temp = *((myFile *)(SD_buff + (pFolder->entryIndex % 16) * 32));
+        temp = dirEntry(buf + (pFolder->entryIndex % 16) * 32);
 
         if (!isFreeEntry(&temp))
         {
@@ -283,7 +649,7 @@ myFile nextFile(myFile *pFolder)
                 while (LFN_entryCnt)
                 {
                     uint8_t tempNameIndex = 0;
-                    LFN_entry_t *entry = (LFN_entry_t *)(SD_buff + (pFolder->entryIndex % 16) * 32);
+                    LFN_entry_t *entry = (LFN_entry_t *)(buf + (pFolder->entryIndex % 16) * 32);
 
                     for (uint8_t i = 0; i < 10; i += 2)
                         tempName[LFN_entryCnt - 1][tempNameIndex++] = entry->LDIR_Name1[i];
@@ -313,7 +679,12 @@ myFile nextFile(myFile *pFolder)
                             }
                         }
 
-                        SD_readSector(startSecOfClus(currentClus) + sectorIndex, SD_buff);
+                        buf = cacheRead(startSecOfClus(currentClus) + sectorIndex);
+                        if (buf == NULL)
+                        {
+                            temp = {0};
+                            return temp;
+                        }
                     }
                 }
 
@@ -325,7 +696,7 @@ myFile nextFile(myFile *pFolder)
 
                 fileNameIndex = 0;
 
-                temp = *((myFile *)(SD_buff + (pFolder->entryIndex % 16) * 32));
+                temp = dirEntry(buf + (pFolder->entryIndex % 16) * 32);
                 temp.fileEntInf.Cluster = currentClus;
                 temp.fileEntInf.sectorIndex = sectorIndex;
                 temp.fileEntInf.entryIndex = pFolder->entryIndex % 16;
@@ -363,7 +734,7 @@ myFile nextFile(myFile *pFolder)
                         return temp;
                     }
                 }
-                SD_readSector(startSecOfClus(currentClus) + sectorIndex, SD_buff);
+                buf = cacheRead(startSecOfClus(currentClus) + sectorIndex);
             }
         }
     }
@@ -468,9 +839,42 @@ char *getExtension(char *file_name)
     return ext;
 }
 
+// file the multiple block read of readByte() belongs to, NULL if none
+static myFile *readOwner = NULL;
+static uint32_t readNextIndex;
+
+/**
+ * @brief  Stop the read stream of readByte() if it belongs to a file
+ *
+ * @param[in] pFile file
+ */
+static void readByteStop(myFile *pFile)
+{
+    if (readOwner != pFile)
+        return;
+    blockDev->readStop();
+    readOwner = NULL;
+}
+
+/**
+ * @brief  Read the next sector of the stream into SD_buff, with what the
+ *         cache holds of it and has not written yet, as File::read() sees it
+ *
+ * @param[in] sector sector the stream is at
+ * @return true/false
+ */
+static bool readNextMerged(uint32_t sector)
+{
+    if (!blockDev->readNext(SD_buff))
+        return false;
+    cacheMerge(sector, SD_buff, 1);
+    return true;
+}
+
 static bool printContent(uint32_t startClus, uint32_t size)
 {
     uint32_t charCnt = 0;
+    uint32_t nextClus;
 
     if (startClus == 0 || size == 0)
         return 0;
@@ -478,18 +882,23 @@ static bool printContent(uint32_t startClus, uint32_t size)
     Serial.println("\n");
     do
     {
-        if (SD_readMultipleSecStart(startSecOfClus(startClus)) == SD_READY)
+        uint32_t runSectors = fatContigRun(startClus, &nextClus) * params.BPB_SecPerClus;
+
+        // the stream is taken from readByte(), then one multiple block
+        // read across the whole contiguous run
+        readByteStop(readOwner);
+        if (blockDev->readStart(startSecOfClus(startClus)))
         {
-            for (uint8_t i = 0; i < params.BPB_SecPerClus; i++)
+            for (uint32_t i = 0; i < runSectors; i++)
             {
-                SD_readMultipleSec(SD_buff);
+                readNextMerged(startSecOfClus(startClus) + i);
                 for (uint16_t c = 0; c < 512; c++)
                 {
                     Serial.print((char)SD_buff[c]);
                     charCnt++;
                     if (charCnt == size)
                     {
-                        SD_readMultipleSecStop();
+                        blockDev->readStop();
                         return true;
                     }
                 }
@@ -500,15 +909,21 @@ static bool printContent(uint32_t startClus, uint32_t size)
             // Serial.println("Content read failed!");
             return false;
         }
-        SD_readMultipleSecStop();
-    } while ((startClus = fatNextClus(startClus)) < FAT_EOC);
+        blockDev->readStop();
+    } while ((startClus = nextClus) < FAT_EOC);
     return true;
 }
 
 void fileClose(myFile *pFile)
 {
-    memset(pFile, 0, sizeof(myFile *));
-    SD_readMultipleSecStop();
+    readByteStop(pFile);
+    memset(pFile, 0, sizeof(myFile));
+}
+
+void fileReset(myFile *pFile)
+{
+    readByteStop(pFile);
+    pFile->entryIndex = 0;
 }
 
 static inline bool isClosed(myFile *pFile)
@@ -518,96 +933,275 @@ static inline bool isClosed(myFile *pFile)
     return false;
 }
 
-uint8_t readByte(myFile *pFile)
+/**
+ * @brief  Read the byte at the index of a file and move the index on
+ *
+ * Consecutive calls on one file stream its sectors with one multiple block
+ * read. On a failure the index stays put and the next call starts over.
+ *
+ * @param[in] pFile file
+ * @return byte read, -1 if the file is closed, its chain ends or the card fails
+ */
+int16_t readByte(myFile *pFile)
 {
-    static bool readStarted = false;
-    static uint32_t Cluster = startCluster(pFile);
-
-    if (pFile->entryIndex == 0)
-    {
-        readStarted = false;
-        Cluster = startCluster(pFile);
-    }
+    static uint32_t Cluster;
+    static uint32_t runLeft;
+    uint32_t clusBytes = (uint32_t)params.BPB_SecPerClus * params.BPB_BytesPerSec;
 
     if (isClosed(pFile))
     {
-        SD_readMultipleSecStop();
-        readStarted = false;
-        return 0;
+        readByteStop(pFile);
+        return -1;
     }
 
-    if (!readStarted)
+    // another file or a moved index takes the stream over from where it is
+    if (readOwner != pFile || pFile->entryIndex != readNextIndex || pFile->entryIndex == 0)
     {
-        SD_readMultipleSecStart(startSecOfClus(Cluster));
-        SD_readMultipleSec(SD_buff);
-        readStarted = true;
-    }
+        readByteStop(readOwner);
 
-    if ((pFile->entryIndex > 0) && (pFile->entryIndex % (params.BPB_SecPerClus * params.BPB_BytesPerSec) == 0))
-    {
-        SD_readMultipleSecStop();
-        Cluster = fatNextClus(Cluster);
+        uint32_t offset = pFile->entryIndex % clusBytes;
+        Cluster = fileClusAt(pFile, pFile->entryIndex / clusBytes, &runLeft);
         if (Cluster >= FAT_EOC)
+            return -1;
+        if (!blockDev->readStart(startSecOfClus(Cluster) + offset / params.BPB_BytesPerSec))
+            return -1;
+        readOwner = pFile;
+        if (!readNextMerged(startSecOfClus(Cluster) + offset / params.BPB_BytesPerSec))
         {
-            SD_readMultipleSecStop();
-            readStarted = false;
-            return 0;
+            readByteStop(pFile);
+            return -1;
         }
-        SD_readMultipleSecStart(startSecOfClus(Cluster));
     }
+    else
+    {
+        // the stream keeps a shared bus between calls, hand it to a device
+        // that waits, the stream picks up again with the next sector
+        blockDev->idle();
+
+        if (pFile->entryIndex % clusBytes == 0)
+        {
+            if (runLeft > 1)
+            {
+                // next cluster is physically adjacent, keep streaming
+                Cluster++;
+                runLeft--;
+            }
+            else
+            {
+                readByteStop(pFile);
+                Cluster = fileClusAt(pFile, pFile->entryIndex / clusBytes, &runLeft);
+                if (Cluster >= FAT_EOC || !blockDev->readStart(startSecOfClus(Cluster)))
+                    return -1;
+                readOwner = pFile;
+            }
+        }
 
-    if (pFile->entryIndex > 0 && (pFile->entryIndex % params.BPB_BytesPerSec == 0))
-        SD_readMultipleSec(SD_buff);
+        // SD_buff holds stale data after a failed block, never hand it out
+        if (pFile->entryIndex % params.BPB_BytesPerSec == 0 &&
+            !readNextMerged(startSecOfClus(Cluster) + (pFile->entryIndex % clusBytes) / params.BPB_BytesPerSec))
+        {
+            readByteStop(pFile);
+            return -1;
+        }
+    }
 
+    readNextIndex = pFile->entryIndex + 1;
     return SD_buff[(pFile->entryIndex++) % params.BPB_BytesPerSec];
 }
 
-bool listDir(const char *path)
+/**
+ * @brief  Open a file at position 0, it is created if it doesn't exist
+ *
+ * @param[in] path path of the folder holding the file
+ * @param[in] filename file name
+ * @return true/false returns false for an invalid path or a directory
+ */
+bool File::open(const char *path, const char *filename)
 {
-    myFile tempFile = pathExists(path);
-    if (startCluster(&tempFile) == 0)
+    myFile dirEnt = fileOpen(path, filename);
+    return open(&dirEnt);
+}
+
+bool File::open(const myFile *dirEnt)
+{
+    close();
+    entry = *dirEnt;
+    if (isClosed(&entry) || isDirectory(&entry))
     {
-        Serial.println("Invalid Path!");
+        reset();
         return false;
     }
-    if (!isDirectory(&tempFile))
-    {
-        if (strcmp(getExtension(fileName), "bimg") == 0)
-        {
-            uint8_t img[1024] = {0};
-            for (int i = 0; i < 1024; i++)
-                img[i] = readByte(&tempFile);
 
-            fileClose(&tempFile);
+    closed = false;
+    return true;
+}
 
-            clearDisplay();
-            displayBmp(img);
-            display();
-        }
-        else
-        {
+/**
+ * @brief  Flush and forget the file
+ * @return true/false result of the flush
+ */
+bool File::close()
+{
+    bool ret = closed || flush();
 
-            printContent(startCluster(&tempFile), tempFile.DIR_FileSize);
-            Serial.println('\n');
-        }
-        return true;
-    }
-    myFile folder = tempFile;
+    reset();
+    return ret;
+}
 
-    do
-    {
-        tempFile = nextFile(&folder);
-        if (isValidFile(&tempFile))
-            dispFile(&tempFile, fileName, 0);
-    } while (!isEndOfDir(&tempFile));
+void File::reset()
+{
+    memset(&entry, 0, sizeof(entry));
+    filePos = 0;
+    clusIdx = 0;
+    clus = 0;
+    closed = true;
+    entryDirty = false;
+}
+
+/**
+ * @brief  Move the position for the next read
+ *
+ * @param[in] pos byte offset from the start of the file, at most its size
+ * @return true/false
+ */
+bool File::seek(uint32_t pos)
+{
+    if (closed || pos > entry.DIR_FileSize)
+        return false;
+
+    // the cluster is looked up again by the next read, through the extents
+    filePos = pos;
+    clus = 0;
     return true;
 }
 
-void listDir_recursive(myFile *pFolder, uint8_t tab)
+/**
+ * @brief  Read from the position on, sector aligned runs go straight from
+ *         the card to buf with one multiple block read
+ *
+ * @param[out] buf destination
+ * @param[in] len number of bytes wanted
+ * @return number of bytes read, short at the end of the file or on error
+ */
+uint32_t File::read(void *buf, uint32_t len)
 {
-    myFile tempFile;
+    uint32_t clusBytes = (uint32_t)params.BPB_SecPerClus * 512;
+    uint8_t *dst = (uint8_t *)buf;
+    uint32_t done = 0;
 
-    do
+    if (closed)
+        return 0;
+    if (len > entry.DIR_FileSize - filePos)
+        len = entry.DIR_FileSize - filePos;
+
+    while (done < len)
+    {
+        uint32_t offset = filePos % clusBytes;
+        uint32_t remain = len - done;
+
+        if (clus == 0 || clusIdx != filePos / clusBytes)
+        {
+            clusIdx = filePos / clusBytes;
+            clus = fileClusAt(&entry, clusIdx, NULL);
+            if (clus >= FAT_EOC)
+            {
+                clus = 0;
+                break;
+            }
+        }
+
+        uint32_t sector = startSecOfClus(clus) + offset / 512;
+        uint16_t secOffset = filePos % 512;
+
+        if (secOffset != 0 || remain < 512)
+        {
+            uint8_t *data = cacheRead(sector);
+            if (data == NULL)
+                break;
+
+            uint16_t n = (remain < (uint32_t)(512 - secOffset)) ? remain : 512 - secOffset;
+            memcpy(dst + done, data + secOffset, n);
+            done += n;
+            filePos += n;
+        }
+        else
+        {
+            // whole sectors across the run of the cluster
+            uint32_t runLeft;
+            fileClusAt(&entry, clusIdx, &runLeft);
+            uint32_t secCnt = (runLeft * clusBytes - offset) / 512;
+            if (secCnt > remain / 512)
+                secCnt = remain / 512;
+
+            if (!blockDev->readSectors(sector, dst + done, secCnt))
+                break;
+            cacheMerge(sector, dst + done, secCnt);
+
+            done += secCnt * 512;
+            filePos += secCnt * 512;
+
+            // inside the run the cluster is found without the extents
+            uint32_t adv = filePos / clusBytes - clusIdx;
+            clusIdx += adv;
+            clus = (adv < runLeft) ? clus + adv : 0;
+        }
+    }
+    return done;
+}
+
+bool listDir(const char *path)
+{
+    myFile tempFile = pathExists(path);
+    if (startCluster(&tempFile) == 0)
+    {
+        Serial.println("Invalid Path!");
+        return false;
+    }
+    if (!isDirectory(&tempFile))
+    {
+#if defined(ARDUINO)
+        if (strcmp(getExtension(fileName), "bimg") == 0)
+        {
+            uint8_t img[1024] = {0};
+            for (int i = 0; i < 1024; i++)
+            {
+                int16_t c = readByte(&tempFile);
+                if (c < 0)
+                    break;
+                img[i] = c;
+            }
+
+            fileClose(&tempFile);
+
+            clearDisplay();
+            displayBmp(img);
+            display();
+        }
+        else
+#endif
+        {
+
+            printContent(startCluster(&tempFile), tempFile.DIR_FileSize);
+            Serial.println('\n');
+        }
+        return true;
+    }
+    myFile folder = tempFile;
+
+    do
+    {
+        tempFile = nextFile(&folder);
+        if (isValidFile(&tempFile))
+            dispFile(&tempFile, fileName, 0);
+    } while (!isEndOfDir(&tempFile));
+    return true;
+}
+
+void listDir_recursive(myFile *pFolder, uint8_t tab)
+{
+    myFile tempFile;
+
+    do
     {
         tempFile = nextFile(pFolder);
         if (isValidFile(&tempFile))
@@ -630,6 +1224,9 @@ static void fileSetStartClus(myFile *pFile, uint32_t cluster)
 
     pFile->DIR_FstClusLO = (uint16_t)(cluster & 0x0000FFFF);
     pFile->DIR_FstClusHI = (uint16_t)((cluster & 0xFFFF0000) >> 16);
+
+    // runs of the old chain no longer apply
+    pFile->extents.cnt = 0;
 }
 
 static void fileSetDate(myFile *pFile, uint16_t year, uint8_t month, uint8_t day)
@@ -653,67 +1250,58 @@ static freeEntInf_t getFreeEntry(myFile *Dir, uint8_t freeEntryCnt)
     frEntInf.Cluster = startCluster(Dir);
     do
     {
-        if (SD_readMultipleSecStart(startSecOfClus(frEntInf.Cluster)) == SD_READY)
+        for (frEntInf.sectorIndex = 0; frEntInf.sectorIndex < params.BPB_SecPerClus; frEntInf.sectorIndex++)
         {
-            for (frEntInf.sectorIndex = 0; frEntInf.sectorIndex < params.BPB_SecPerClus; frEntInf.sectorIndex++)
+            uint8_t *buf = cacheRead(startSecOfClus(frEntInf.Cluster) + frEntInf.sectorIndex);
+            if (buf == NULL)
             {
-                SD_readMultipleSec(SD_buff);
-                for (frEntInf.entryIndex = 0; frEntInf.entryIndex < 16; frEntInf.entryIndex++)
+                frEntInf = {0};
+                return frEntInf;
+            }
+
+            for (frEntInf.entryIndex = 0; frEntInf.entryIndex < 16; frEntInf.entryIndex++)
+            {
+                myFile temp = dirEntry(buf + frEntInf.entryIndex * 32);
+                if (isFreeEntry(&temp) || isEndOfDir(&temp))
                 {
-                    myFile temp = *((myFile *)(SD_buff + frEntInf.entryIndex * 32));
-                    if (isFreeEntry(&temp) || isEndOfDir(&temp))
+                    if (isEndOfDir(&temp))
                     {
-                        if (isEndOfDir(&temp))
+                        if ((frEntInf.entryIndex + freeEntryCnt) > 15)
                         {
-                            SD_readMultipleSecStop();
-                            if ((frEntInf.entryIndex + freeEntryCnt) > 15)
+                            buf = cacheWrite(startSecOfClus(frEntInf.Cluster) + frEntInf.sectorIndex);
+                            for (uint8_t i = frEntInf.entryIndex; i < 16; i++)
                             {
-                                SD_readSector(startSecOfClus(frEntInf.Cluster) + frEntInf.sectorIndex, SD_buff);
-                                for (uint8_t i = frEntInf.entryIndex; i < 16; i++)
-                                {
-                                    myFile *pFile = (myFile *)(SD_buff + (i * 32));
-                                    pFile->DIR_Name[0] = 0xE5;
-                                }
-                                SD_writeSector(startSecOfClus(frEntInf.Cluster) + frEntInf.sectorIndex, SD_buff);
-
-                                frEntInf.sectorIndex++;
-                                frEntInf.entryIndex = 0;
+                                myFile *pFile = (myFile *)(buf + (i * 32));
+                                pFile->DIR_Name[0] = 0xE5;
                             }
-                            return frEntInf;
-                        }
 
-                        if (freeEntryCnt == 1)
-                        {
-                            SD_readMultipleSecStop();
-                            return frEntInf;
+                            frEntInf.sectorIndex++;
+                            frEntInf.entryIndex = 0;
                         }
-                        uint8_t i;
-                        for (i = 0; i < freeEntryCnt; i++)
-                        {
-                            frEntInf.entryIndex += i;
-                            if (frEntInf.entryIndex == 16)
-                                break;
+                        return frEntInf;
+                    }
 
-                            temp = *((myFile *)(SD_buff + frEntInf.entryIndex * 32));
-                            if (!isFreeEntry(&temp))
-                                break;
-                        }
-                        if (i != freeEntryCnt)
-                            continue;
-                        SD_readMultipleSecStop();
-                        frEntInf.entryIndex -= (freeEntryCnt - 1);
+                    if (freeEntryCnt == 1)
                         return frEntInf;
+
+                    uint8_t i;
+                    for (i = 0; i < freeEntryCnt; i++)
+                    {
+                        frEntInf.entryIndex += i;
+                        if (frEntInf.entryIndex == 16)
+                            break;
+
+                        temp = dirEntry(buf + frEntInf.entryIndex * 32);
+                        if (!isFreeEntry(&temp))
+                            break;
                     }
+                    if (i != freeEntryCnt)
+                        continue;
+                    frEntInf.entryIndex -= (freeEntryCnt - 1);
+                    return frEntInf;
                 }
             }
         }
-        else
-        {
-            frEntInf = {0};
-            return frEntInf;
-        }
-
-        SD_readMultipleSecStop();
 
     } while ((frEntInf.Cluster = fatNextClus(frEntInf.Cluster)) < FAT_EOC);
     frEntInf = {0};
@@ -829,34 +1417,66 @@ static uint8_t create_sum(myFile *entry)
     return Sum;
 }
 
-static bool updateFSInfo(uint32_t nxtFreeClus)
+static bool updateFSInfo(uint32_t nxtFreeClus, int32_t allocCnt)
 {
-    if (SD_readSector(FSInfo_SEC, SD_buff) == SD_READ_SUCCESS)
+    uint8_t *buf = cacheWrite(FSInfoSector);
+    if (buf != NULL)
     {
-        FSInfo_t *p_fsinfo = (FSInfo_t *)SD_buff;
+        FSInfo_t *p_fsinfo = (FSInfo_t *)buf;
         p_fsinfo->FSI_Nxt_Free = nxtFreeClus;
-        p_fsinfo->FSI_Free_Count--;
-
-        if (SD_writeSector(FSInfo_SEC, SD_buff) == SD_WRITE_SUCCESS)
-            return true;
-        else
-            return false;
+        // 0xFFFFFFFF marks the count as unknown
+        if (p_fsinfo->FSI_Free_Count != 0xFFFFFFFF)
+            p_fsinfo->FSI_Free_Count -= allocCnt;
+        return true;
     }
     return false;
 }
 
+/**
+ * @brief  Charge clusters to the FSInfo free count, the next free hint is kept
+ *
+ * @param[in] allocCnt clusters taken, negative for clusters given back
+ * @return true/false
+ */
+static bool adjustFreeCount(int32_t allocCnt)
+{
+    uint8_t *buf = cacheRead(FSInfoSector);
+    return buf != NULL && updateFSInfo(((FSInfo_t *)buf)->FSI_Nxt_Free, allocCnt);
+}
+
 static uint32_t getNxtFreeClus()
 {
-    if (SD_readSector(FSInfo_SEC, SD_buff) == SD_READ_SUCCESS)
+    uint8_t *buf = cacheRead(FSInfoSector);
+    if (buf != NULL)
     {
 
-        FSInfo_t *p_fsinfo = (FSInfo_t *)SD_buff;
+        FSInfo_t *p_fsinfo = (FSInfo_t *)buf;
         uint32_t nxtFreeClus = p_fsinfo->FSI_Nxt_Free;
 
-        while (fatNextClus(nxtFreeClus) != 0x00000000)
-            nxtFreeClus++;
+        if (freeBits != NULL || freeCounts != NULL)
+        {
+            // the map makes a full pass cheap, wrap around once
+            uint32_t lastClus = lastCluster();
+            if (nxtFreeClus < 2 || nxtFreeClus > lastClus)
+                nxtFreeClus = 2;
+            for (uint8_t pass = 0; pass < 2; pass++)
+            {
+                while ((nxtFreeClus = freeMapSkip(nxtFreeClus, lastClus)) <= lastClus && !clusIsFree(nxtFreeClus))
+                    nxtFreeClus++;
+                if (nxtFreeClus <= lastClus)
+                    break;
+                nxtFreeClus = 2;
+            }
+            if (nxtFreeClus > lastClus)
+                return 0xFFFFFFFF;
+        }
+        else
+        {
+            while (fatNextClus(nxtFreeClus) != 0x00000000)
+                nxtFreeClus++;
+        }
 
-        if (updateFSInfo(nxtFreeClus))
+        if (updateFSInfo(nxtFreeClus, 1))
         {
             return nxtFreeClus;
         }
@@ -867,6 +1487,125 @@ static uint32_t getNxtFreeClus()
         return 0xFFFFFFFF;
 }
 
+/**
+ * @brief  Find a run of free clusters, starting on an allocation unit
+ *         boundary when the AU of the card is known
+ *
+ * @param[in] clusCnt number of clusters needed
+ * @return first cluster of the run, 0 if there is none
+ */
+static uint32_t findFreeRun(uint32_t clusCnt)
+{
+    uint32_t lastClus = lastCluster();
+    uint32_t step = (auClusters != 0) ? auClusters : 1;
+    uint32_t clus = (auClusters != 0) ? auFirstClus : 2;
+
+    // start at the AU holding the free cluster hint
+    uint8_t *buf = cacheRead(FSInfoSector);
+    if (buf != NULL)
+    {
+        uint32_t hint = ((FSInfo_t *)buf)->FSI_Nxt_Free;
+        if (hint > clus && hint <= lastClus)
+            clus += (hint - clus) / step * step;
+    }
+
+    while (clus + clusCnt - 1 <= lastClus)
+    {
+        // jump over what the free space map rules out, keeping the alignment
+        uint32_t next = freeMapSkip(clus, lastClus);
+        if (next != clus)
+        {
+            clus += (next - clus + step - 1) / step * step;
+            continue;
+        }
+
+        uint32_t i = 0;
+        while (i < clusCnt && clusIsFree(clus + i))
+            i++;
+        if (i == clusCnt)
+            return clus;
+
+        // carry on with the AU after the cluster in use
+        clus += (i / step + 1) * step;
+    }
+    return 0;
+}
+
+/**
+ * @brief  Allocate clusters and link them behind the end of a chain
+ *
+ * Requests of at least one allocation unit start on an AU boundary, the
+ * card only keeps its speed class for AU aligned sequential writes.
+ *
+ * @param[in] lastClus last cluster of the chain, 0 to start a new chain
+ * @param[in] clusCnt number of clusters to add
+ * @param[in] contiguous fail rather than fall back to scattered clusters
+ * @return first added cluster, 0 if the volume is full
+ */
+static uint32_t allocClusters(uint32_t lastClus, uint32_t clusCnt, bool contiguous = false)
+{
+    uint32_t firstClus = 0;
+
+    if (clusCnt == 0)
+        return 0;
+
+    if (contiguous || (auClusters != 0 && clusCnt >= auClusters))
+        firstClus = findFreeRun(clusCnt);
+
+    if (firstClus != 0)
+    {
+        // free clusters in front of the run stay with the hint
+        if (!adjustFreeCount(clusCnt))
+            return 0;
+
+        fatLinkRun(firstClus, clusCnt);
+
+        if (lastClus != 0)
+            fatSetNextClus(lastClus, firstClus);
+        return firstClus;
+    }
+
+    if (contiguous)
+        return 0;
+
+    // first fit, one cluster at a time
+    for (uint32_t i = 0; i < clusCnt; i++)
+    {
+        uint32_t clus = getNxtFreeClus();
+        if (clus == 0xFFFFFFFF)
+            return 0;
+
+        fatSetNextClus(clus, FAT_EOC);
+        if (lastClus != 0)
+            fatSetNextClus(lastClus, clus);
+        if (firstClus == 0)
+            firstClus = clus;
+        lastClus = clus;
+    }
+    return firstClus;
+}
+
+/**
+ * @brief  Free a chain of clusters and give them back to the free count
+ *
+ * @param[in] clus first cluster of the chain, FAT_EOC or above frees nothing
+ * @return true/false
+ */
+static bool fatFreeChain(uint32_t clus)
+{
+    uint32_t lastClus = lastCluster();
+    int32_t freed = 0;
+
+    while (clus >= 2 && clus <= lastClus)
+    {
+        uint32_t nextClus = fatNextClus(clus);
+        fatSetNextClus(clus, 0x00000000);
+        freed++;
+        clus = nextClus;
+    }
+    return freed == 0 || adjustFreeCount(-freed);
+}
+
 static myFile createFile(myFile *pathDir, const char *filename, bool isDir)
 {
 
@@ -881,6 +1620,7 @@ static myFile createFile(myFile *pathDir, const char *filename, bool isDir)
     memset(newFile.DIR_ext, ' ', 3);
 
     freeEntInf_t frEnt;
+    uint8_t *buf;
 
     if (mixedLetters(filename) || (fileNameLength(filename) > 8))
     {
@@ -920,11 +1660,16 @@ static myFile createFile(myFile *pathDir, const char *filename, bool isDir)
         uint8_t temp = lfnEntCnt;
 
         frEnt = getFreeEntry(pathDir, lfnEntCnt + 1);
-        SD_readSector(startSecOfClus(frEnt.Cluster) + frEnt.sectorIndex, SD_buff);
+        buf = cacheWrite(startSecOfClus(frEnt.Cluster) + frEnt.sectorIndex);
+        if (buf == NULL)
+        {
+            newFile = {0};
+            return newFile;
+        }
 
         while (lfnEntCnt)
         {
-            LFN_entry_t *entry = (LFN_entry_t *)(SD_buff + (frEnt.entryIndex + lfnEntCnt - 1) * 32);
+            LFN_entry_t *entry = (LFN_entry_t *)(buf + (frEnt.entryIndex + lfnEntCnt - 1) * 32);
             entry->LDIR_Attr = ATTR_LONG_FILE_NAME;
             entry->LDIR_FstClusLO = 0;
             entry->LDIR_Type = 0;
@@ -961,7 +1706,12 @@ static myFile createFile(myFile *pathDir, const char *filename, bool isDir)
 
     {
         frEnt = getFreeEntry(pathDir, 1);
-        SD_readSector(startSecOfClus(frEnt.Cluster) + frEnt.sectorIndex, SD_buff);
+        buf = cacheWrite(startSecOfClus(frEnt.Cluster) + frEnt.sectorIndex);
+        if (buf == NULL)
+        {
+            newFile = {0};
+            return newFile;
+        }
 
         for (uint8_t i = 0; i < 9; i++)
         {
@@ -1005,10 +1755,10 @@ static myFile createFile(myFile *pathDir, const char *filename, bool isDir)
     newFile.fileEntInf.sectorIndex = frEnt.sectorIndex;
     newFile.fileEntInf.entryIndex = frEnt.entryIndex;
 
-    myFile *pFile = (myFile *)(SD_buff + frEnt.entryIndex * 32);
+    myFile *pFile = (myFile *)(buf + frEnt.entryIndex * 32);
     memcpy(pFile, &newFile, 32);
 
-    if (SD_writeSector(startSecOfClus(frEnt.Cluster) + frEnt.sectorIndex, SD_buff) == SD_WRITE_SUCCESS)
+    if (cacheSync())
     {
         Serial.println("File Created!");
         return newFile;
@@ -1022,6 +1772,7 @@ static myFile createFile(myFile *pathDir, const char *filename, bool isDir)
 
 myFile fileOpen(const char *path, const char *filename)
 {
+    API_STATS(FS_API_FILE_OPEN);
 
     myFile pathDir = pathExists(path);
 
@@ -1081,81 +1832,654 @@ myFile createDirectory(const char *path, const char *dirName)
     parentDir.DIR_Name[0] = '.';
     parentDir.DIR_Name[1] = '.';
 
-    memset(SD_buff, 0, 512);
+    for (uint8_t sectorIndex = params.BPB_SecPerClus; sectorIndex > 1; sectorIndex--)
+        cacheZero(startSecOfClus(dirStartClus) + sectorIndex - 1);
 
-    for (uint8_t sectorIndex = 0; sectorIndex < params.BPB_SecPerClus; sectorIndex++)
-        SD_writeSector(startSecOfClus(dirStartClus) + sectorIndex, SD_buff);
-
-    memcpy(SD_buff, &thisDir, 32);
-    memcpy(SD_buff + 32, &parentDir, 32);
+    uint8_t *buf = cacheZero(startSecOfClus(dirStartClus));
+    if (buf != NULL)
+    {
+        memcpy(buf, &thisDir, 32);
+        memcpy(buf + 32, &parentDir, 32);
+    }
 
-    SD_writeSector(startSecOfClus(dirStartClus), SD_buff);
+    cacheSync();
 
     return thisDir;
 }
 
-bool fileWrite(myFile *pFile, const char *data)
+/**
+ * @brief  Write the directory entry of a file back through the cache
+ *
+ * @param[in] pFile file with its size and start cluster updated
+ * @return true/false
+ */
+static bool storeDirEntry(myFile *pFile)
 {
-    uint32_t startClus = startCluster(pFile);
-    uint16_t byteIndex = pFile->DIR_FileSize % params.BPB_BytesPerSec;
-    uint32_t sectorIndex = pFile->DIR_FileSize / params.BPB_BytesPerSec;
-    uint32_t clusterCnt = (sectorIndex / params.BPB_SecPerClus) + 1;
-    uint32_t byteCnt = 0;
-    bool moreData = true;
+    uint8_t *buf = cacheWrite(startSecOfClus(pFile->fileEntInf.Cluster) + pFile->fileEntInf.sectorIndex);
+    if (buf == NULL)
+        return false;
 
-    sectorIndex = sectorIndex % params.BPB_SecPerClus;
-    uint32_t tempClus;
+    myFile *p_temp = (myFile *)(buf + pFile->fileEntInf.entryIndex * 32);
+    memcpy(p_temp, pFile, 32);
+    return true;
+}
 
-    if (clusterCnt > 1)
+/**
+ * @brief  Write data into a file at a position, growing its chain as needed
+ *
+ * Partial sectors are changed in the cache and reach the card on eviction
+ * or sync, whole sectors are written straight from data. The size and the
+ * directory entry are left to the caller.
+ *
+ * @param[in] pFile file
+ * @param[in] pos byte offset to write at, at most the size of the file
+ * @param[in] data bytes to write
+ * @param[in] len number of bytes
+ * @return true/false
+ */
+static bool fileWriteAt(myFile *pFile, uint32_t pos, const uint8_t *data, uint32_t len)
+{
+    uint32_t clusBytes = (uint32_t)params.BPB_SecPerClus * 512;
+    uint32_t nextClus;
+    uint32_t written = 0;
+
+    if (len == 0)
+        return true;
+
+    // the cluster holding the byte before pos always exists, clusters
+    // already chained behind it count towards the space needed
+    uint32_t lastIdx = (pos + len - 1) / clusBytes;
+    uint32_t tailIdx = (pos == 0) ? 0 : (pos - 1) / clusBytes;
+    uint32_t tailClus = fileClusAt(pFile, tailIdx, NULL);
+    if (tailClus >= FAT_EOC)
+        return false;
+    while (tailIdx < lastIdx && (nextClus = fileClusAt(pFile, tailIdx + 1, NULL)) < FAT_EOC)
     {
-        while (clusterCnt)
+        tailClus = nextClus;
+        tailIdx++;
+    }
+    if (tailIdx < lastIdx && allocClusters(tailClus, lastIdx - tailIdx) == 0)
+        return false;
+
+    uint32_t clusIdx = pos / clusBytes;
+    uint32_t offset = pos % clusBytes;
+    uint32_t clus = fileClusAt(pFile, clusIdx, NULL);
+    if (clus >= FAT_EOC)
+        return false;
+
+    while (written < len)
+    {
+        if (offset == clusBytes)
         {
-            tempClus = startClus;
-            startClus = fatNextClus(startClus);
-            clusterCnt--;
+            clus = fileClusAt(pFile, ++clusIdx, NULL);
+            offset = 0;
+        }
+
+        uint32_t sector = startSecOfClus(clus) + offset / 512;
+        uint16_t secOffset = offset % 512;
+        uint32_t remain = len - written;
+
+        if (secOffset != 0 || remain < 512)
+        {
+            // partial sector goes through the cache, one past the end of
+            // the file holds nothing worth reading
+            uint16_t n = (remain < (uint32_t)(512 - secOffset)) ? remain : 512 - secOffset;
+            uint8_t *buf;
+
+            if (secOffset == 0 && pos + written >= pFile->DIR_FileSize)
+                buf = cacheZero(sector);
+            else
+                buf = cacheWrite(sector);
+            if (buf == NULL)
+                return false;
+
+            memcpy(buf + secOffset, data + written, n);
+            written += n;
+            offset += n;
+        }
+        else
+        {
+            // whole sectors straight from the caller, across the run of the cluster
+            uint32_t runLeft;
+            uint32_t maxSec = remain / 512;
+
+            fileClusAt(pFile, clusIdx, &runLeft);
+            uint32_t secCnt = (runLeft * clusBytes - offset) / 512;
+            if (secCnt > maxSec)
+                secCnt = maxSec;
+
+            if (!blockDev->writeSectors(sector, data + written, secCnt))
+                return false;
+            cacheWritten(sector, data + written, secCnt);
+
+            written += secCnt * 512;
+
+            // position relative to the start of the run
+            uint32_t runPos = offset + secCnt * 512;
+            uint32_t adv = (runPos - 1) / clusBytes;
+            clusIdx += adv;
+            clus += adv;
+            offset = runPos - adv * clusBytes;
         }
-        uint32_t nextClus = getNxtFreeClus();
-        fatSetNextClus(tempClus, nextClus);
-        fatSetNextClus(nextClus, FAT_EOC);
     }
+    return true;
+}
+
+/**
+ * @brief  Append data to a file, zero bytes included
+ *
+ * @param[in] pFile file
+ * @param[in] data bytes to append
+ * @param[in] len number of bytes
+ * @return true/false
+ */
+bool fileWrite(myFile *pFile, const void *data, uint32_t len)
+{
+    API_STATS(FS_API_FILE_WRITE);
+
+    if (len == 0)
+        return true;
+
+    if (!fileWriteAt(pFile, pFile->DIR_FileSize, (const uint8_t *)data, len))
+        return false;
+
+    pFile->DIR_FileSize += len;
+
+    if (!storeDirEntry(pFile))
+        return false;
+    return cacheSync();
+}
+
+bool fileWrite(myFile *pFile, const char *data)
+{
+    return fileWrite(pFile, data, strlen(data));
+}
+
+/**
+ * @brief  Write at the position, zero bytes included
+ *
+ * Bytes collect in the cached sector of the position and whole sectors
+ * are written straight from buf. The directory entry and FSInfo reach
+ * the card on flush() or close(), seek(size()) first to append.
+ *
+ * @param[in] buf data to write
+ * @param[in] len number of bytes
+ * @return number of bytes written, 0 on error
+ */
+uint32_t File::write(const void *buf, uint32_t len)
+{
+    if (closed || len == 0)
+        return 0;
+
+    if (!fileWriteAt(&entry, filePos, (const uint8_t *)buf, len))
+        return 0;
+
+    filePos += len;
+    if (filePos > entry.DIR_FileSize)
+    {
+        entry.DIR_FileSize = filePos;
+        entryDirty = true;
+    }
+
+    // looked up again by the next read
+    clus = 0;
+    return len;
+}
+
+/**
+ * @brief  Write the directory entry and everything cached to the card
+ * @return true/false
+ */
+bool File::flush()
+{
+    if (closed)
+        return false;
+
+    if (entryDirty)
+    {
+        if (!storeDirEntry(&entry))
+            return false;
+        entryDirty = false;
+    }
+    return cacheSync();
+}
+
+// handles of fileOpenHandle(), a free one is closed
+static File filePool[MYSDFAT_OPEN_FILES];
+
+/**
+ * @brief  Take a handle from the pool, a file that is open already keeps
+ *         its handle so its size and position aren't split between two
+ *
+ * @param[in] path path of the folder holding the file
+ * @param[in] filename file name, it is created if it doesn't exist
+ * @return handle, NULL for an invalid path or with every handle in use
+ */
+File *fileOpenHandle(const char *path, const char *filename)
+{
+    File *freeHandle = NULL;
+    myFile dirEnt = fileOpen(path, filename);
+
+    if (isClosed(&dirEnt))
+        return NULL;
 
-    if (byteIndex != 0)
-        SD_readSector(startSecOfClus(startClus) + sectorIndex, SD_buff);
-    for (uint32_t sector = sectorIndex; sector < params.BPB_SecPerClus; sector++)
+    for (uint8_t i = 0; i < MYSDFAT_OPEN_FILES; i++)
     {
-        for (uint32_t i = byteIndex; i < 512; i++)
+        File *pFile = &filePool[i];
+        if (!pFile->isOpen())
         {
-            SD_buff[i] = data[byteCnt++];
-            if (byteCnt == strlen(data))
-            {
-                moreData = false;
-                break;
-            }
+            if (freeHandle == NULL)
+                freeHandle = pFile;
         }
-        byteIndex = 0;
+        else if (pFile->entry.fileEntInf.Cluster == dirEnt.fileEntInf.Cluster &&
+                 pFile->entry.fileEntInf.sectorIndex == dirEnt.fileEntInf.sectorIndex &&
+                 pFile->entry.fileEntInf.entryIndex == dirEnt.fileEntInf.entryIndex)
+            return pFile;
+    }
+
+    if (freeHandle == NULL || !freeHandle->open(&dirEnt))
+        return NULL;
+    return freeHandle;
+}
+
+/**
+ * @brief  Flush a handle and give it back to the pool
+ *
+ * @param[in] pFile handle from fileOpenHandle()
+ * @return true/false result of the flush
+ */
+bool fileCloseHandle(File *pFile)
+{
+    return pFile != NULL && pFile->close();
+}
+
+/**
+ * @brief  Flush every handle of the pool
+ * @return true/false
+ */
+bool mySdFat_flush()
+{
+    bool ret = true;
+
+    for (uint8_t i = 0; i < MYSDFAT_OPEN_FILES; i++)
+    {
+        if (filePool[i].isOpen() && !filePool[i].flush())
+            ret = false;
+    }
+    return cacheSync() && ret;
+}
+
+/**
+ * @brief  Give an empty file one contiguous run of clusters from its start
+ *
+ * A run the chain already starts with, from an earlier reservation, is kept
+ * when it is long enough. Otherwise a new run is taken and the old chain is
+ * given back as a whole.
+ *
+ * @param[in] pFile empty file
+ * @param[in] clusCnt clusters the run has to hold
+ * @return first cluster of the run, 0 if no contiguous run of that size is free
+ */
+static uint32_t fileReserveRun(myFile *pFile, uint32_t clusCnt)
+{
+    uint32_t firstClus = startCluster(pFile);
 
-        if (SD_writeSector(startSecOfClus(startClus) + sector, SD_buff) == SD_WRITE_ERROR)
+    if (firstClus >= 2 && firstClus < FAT_EOC)
+    {
+        uint32_t runLen = 1;
+        while (runLen < clusCnt && fatNextClus(firstClus + runLen - 1) == firstClus + runLen)
+            runLen++;
+        if (runLen == clusCnt)
+            return firstClus;
+    }
+
+    uint32_t runClus = allocClusters(0, clusCnt, true);
+    if (runClus == 0)
+        return 0;
+
+    if (!fatFreeChain(firstClus))
+        return 0;
+    fileSetStartClus(pFile, runClus);
+    return runClus;
+}
+
+/**
+ * @brief  Reserve physically contiguous clusters for a file ahead of writing
+ *
+ * The chain is written a FAT sector at a time and its run is recorded in
+ * the extents of the file, so writes up to the reserved size go straight
+ * to data sectors without touching the FAT. The size of the file is kept,
+ * reserved clusters past its end are still given back by fileDelete().
+ *
+ * @param[in] pFile file to grow
+ * @param[in] bytes size the chain has to hold
+ * @return true/false returns false if no contiguous run of that size is free
+ */
+bool fileAllocate(myFile *pFile, uint32_t bytes)
+{
+    uint32_t clusBytes = (uint32_t)params.BPB_SecPerClus * 512;
+    uint32_t clusCnt = (bytes + clusBytes - 1) / clusBytes;
+    fileExtents_t *ext = &pFile->extents;
+
+    if (isClosed(pFile) || clusCnt == 0)
+        return false;
+
+    if (pFile->DIR_FileSize == 0)
+    {
+        // the chain has to be one run from its start
+        uint32_t firstClus = fileReserveRun(pFile, clusCnt);
+        if (firstClus == 0)
             return false;
 
-        if (!moreData)
+        ext->run[0].fileClus = 0;
+        ext->run[0].firstClus = firstClus;
+        ext->run[0].clusCnt = clusCnt;
+        ext->cnt = 1;
+    }
+    else
+    {
+        // find the end of the chain, clusters already there count
+        uint32_t tailIdx = 0;
+        uint32_t tailClus = fileClusAt(pFile, 0, NULL);
+        uint32_t nextClus;
+
+        if (tailClus >= FAT_EOC)
+            return false;
+        while (tailIdx + 1 < clusCnt && (nextClus = fileClusAt(pFile, tailIdx + 1, NULL)) < FAT_EOC)
         {
-            pFile->DIR_FileSize += strlen(data);
+            tailClus = nextClus;
+            tailIdx++;
+        }
+        if (tailIdx + 1 >= clusCnt)
+            return true;
+
+        uint32_t addCnt = clusCnt - tailIdx - 1;
+        uint32_t firstClus = allocClusters(tailClus, addCnt, true);
+        if (firstClus == 0)
+            return false;
 
-            if (SD_readSector(startSecOfClus(pFile->fileEntInf.Cluster) + pFile->fileEntInf.sectorIndex, SD_buff) == SD_READ_SUCCESS)
+        // the window ends at the tail after the walk, add the new run to it
+        fileExtent_t *last = &ext->run[ext->cnt - 1];
+        if (firstClus == tailClus + 1)
+            last->clusCnt += addCnt;
+        else
+        {
+            if (ext->cnt == FILE_EXTENTS)
             {
-                myFile *p_temp = (myFile *)(SD_buff + pFile->fileEntInf.entryIndex * 32);
-                memcpy(p_temp, pFile, 32);
-                if (SD_writeSector(startSecOfClus(pFile->fileEntInf.Cluster) + pFile->fileEntInf.sectorIndex, SD_buff) == SD_WRITE_SUCCESS)
-                    return true;
+                memmove(&ext->run[0], &ext->run[1], (FILE_EXTENTS - 1) * sizeof(fileExtent_t));
+                ext->cnt--;
+                last--;
             }
+            fileExtent_t *run = &ext->run[ext->cnt++];
+            run->fileClus = last->fileClus + last->clusCnt;
+            run->firstClus = firstClus;
+            run->clusCnt = addCnt;
+        }
+    }
+
+    // chain and entry reach the card before any data does
+    if (!storeDirEntry(pFile))
+        return false;
+    return cacheSync();
+}
+
+// ping-pong capture, see streamBegin(); streamPut() may run in an ISR and
+// only ever fills a buffer streamTask() is done with
+static myFile *streamFile = NULL;
+static uint8_t *streamBuf[2];
+static uint16_t streamBufSectors;
+static uint32_t streamFirstClus;
+static uint32_t streamCapacity;
+static uint32_t streamWritten;
+static bool streamFailed;
+static uint8_t streamWriteBuf;
+static volatile bool streamOn = false;
+static volatile bool streamFull[2];
+static volatile uint8_t streamFillBuf;
+static volatile uint16_t streamFillLen;
+static volatile uint32_t streamAccepted;
+static fsStreamStats_t streamStat;
+
+/**
+ * @brief  Write one buffer into the next sectors of the stream region
+ *
+ * @param[in] buf data to write
+ * @param[in] secCnt number of sectors
+ * @return true/false
+ */
+static bool streamWriteSectors(const uint8_t *buf, uint16_t secCnt)
+{
+    uint32_t start = micros();
+
+    for (uint16_t i = 0; i < secCnt; i++)
+    {
+        if (!blockDev->writeNext(buf + i * 512))
+        {
+            streamFailed = true;
             return false;
         }
     }
+    cacheWritten(startSecOfClus(streamFirstClus) + streamWritten / 512, buf, secCnt);
+
+    uint32_t us = micros() - start;
+    streamStat.buffers++;
+    streamStat.writeUs += us;
+    if (us > streamStat.maxWriteUs)
+        streamStat.maxWriteUs = us;
+
+    // how far the producer got into the other buffer meanwhile
+    uint16_t fill = streamFull[streamFillBuf] ? streamBufSectors * 512 : streamFillLen;
+    if (fill > streamStat.maxFill)
+        streamStat.maxFill = fill;
+
+    streamWritten += (uint32_t)secCnt * 512;
+    return true;
+}
+
+/**
+ * @brief  Start capturing into a contiguous region preallocated for a file
+ *
+ * The region is written with one multiple block stream and the directory
+ * entry is only touched again by streamEnd(). The caller fills one buffer
+ * through streamPut() while streamTask() writes the other.
+ *
+ * @param[in] pFile empty file, must stay valid until streamEnd()
+ * @param[in] bytes size of the region, rounded up to whole clusters
+ * @param[in] bufs two buffers of bufSectors * 512 bytes each, back to back
+ * @param[in] bufSectors sectors per buffer, 1 to 64
+ * @return true/false returns false if no contiguous run of that size is free
+ */
+bool streamBegin(myFile *pFile, uint32_t bytes, uint8_t *bufs, uint16_t bufSectors)
+{
+    uint32_t clusBytes = (uint32_t)params.BPB_SecPerClus * 512;
+    uint32_t clusCnt = (bytes + clusBytes - 1) / clusBytes;
+
+    // streamPut() counts buffer bytes in 16 bits
+    if (bufSectors == 0 || bufSectors > 64)
+        return false;
+
+    if (streamFile != NULL || pFile->DIR_FileSize != 0 || clusCnt == 0 || bufs == NULL)
+        return false;
+
+    // a run reserved by fileAllocate() is written as it is
+    uint32_t firstClus = fileReserveRun(pFile, clusCnt);
+    if (firstClus == 0)
+        return false;
+
+    // chain and entry reach the card before any data does
+    if (!storeDirEntry(pFile) || !cacheSync())
+        return false;
+
+    if (!blockDev->writeStart(startSecOfClus(firstClus), clusCnt * params.BPB_SecPerClus))
+        return false;
+
+    streamFile = pFile;
+    streamBuf[0] = bufs;
+    streamBuf[1] = bufs + (uint32_t)bufSectors * 512;
+    streamBufSectors = bufSectors;
+    streamFirstClus = firstClus;
+    streamCapacity = clusCnt * clusBytes;
+    streamWritten = 0;
+    streamFailed = false;
+    streamWriteBuf = 0;
+    streamFull[0] = false;
+    streamFull[1] = false;
+    streamFillBuf = 0;
+    streamFillLen = 0;
+    streamAccepted = 0;
+    memset(&streamStat, 0, sizeof(streamStat));
+    streamOn = true;
     return true;
 }
 
+/**
+ * @brief  Queue data for the stream, safe to call from an interrupt
+ *
+ * Data that finds both buffers waiting for the card, or the region full,
+ * is dropped and counted as an overrun.
+ *
+ * @param[in] data bytes to append
+ * @param[in] len number of bytes
+ * @return number of bytes taken
+ */
+uint16_t streamPut(const void *data, uint16_t len)
+{
+    const uint8_t *src = (const uint8_t *)data;
+    uint16_t bufBytes = streamBufSectors * 512;
+    uint16_t put = 0;
+
+    if (!streamOn)
+        return 0;
+
+    while (put < len)
+    {
+        uint8_t fillBuf = streamFillBuf;
+        uint16_t fillLen = streamFillLen;
+
+        if (streamFull[fillBuf] || streamAccepted == streamCapacity)
+        {
+            streamStat.overruns++;
+            streamStat.droppedBytes += len - put;
+            break;
+        }
+
+        uint32_t n = bufBytes - fillLen;
+        if (n > (uint32_t)(len - put))
+            n = len - put;
+        if (n > streamCapacity - streamAccepted)
+            n = streamCapacity - streamAccepted;
+
+        memcpy(streamBuf[fillBuf] + fillLen, src + put, n);
+        put += n;
+        streamAccepted += n;
+        fillLen += n;
+
+        if (fillLen == bufBytes)
+        {
+            // hand it to streamTask(), carry on in the other one
+            streamFillLen = 0;
+            streamFull[fillBuf] = true;
+            streamFillBuf = fillBuf ^ 1;
+        }
+        else
+            streamFillLen = fillLen;
+    }
+
+    streamStat.bytes += put;
+    return put;
+}
+
+/**
+ * @brief  Write the buffers streamPut() has filled, call it from the main loop
+ * @return true/false returns false once a write has failed
+ */
+bool streamTask()
+{
+    if (streamFile == NULL || streamFailed)
+        return false;
+
+    while (streamFull[streamWriteBuf])
+    {
+        if (!streamWriteSectors(streamBuf[streamWriteBuf], streamBufSectors))
+            return false;
+
+        streamFull[streamWriteBuf] = false;
+        streamWriteBuf ^= 1;
+    }
+
+    // nothing to write until the next buffer fills, free a shared bus
+    blockDev->idle();
+    return true;
+}
+
+/**
+ * @brief  Stop capturing, write what is left and set the file size
+ *
+ * The file keeps the clusters holding data, the rest of the region is
+ * given back.
+ *
+ * @return true/false
+ */
+bool streamEnd()
+{
+    uint32_t clusBytes = (uint32_t)params.BPB_SecPerClus * 512;
+    bool done;
+
+    if (streamFile == NULL)
+        return false;
+
+    // no more data, then drain the full buffers in order
+    streamOn = false;
+    done = streamTask();
+
+    // partial last buffer, the tail of its last sector is zero filled
+    if (done && streamFillLen != 0)
+    {
+        uint16_t fillLen = streamFillLen;
+        uint16_t secCnt = (fillLen + 511) / 512;
+        uint8_t *buf = streamBuf[streamFillBuf];
+
+        memset(buf + fillLen, 0, secCnt * 512 - fillLen);
+        if (streamWriteSectors(buf, secCnt))
+            streamWritten -= secCnt * 512 - fillLen;
+        else
+            done = false;
+    }
+
+    if (!blockDev->writeStop())
+        done = false;
+
+    // the file ends with the last byte known to be on the card
+    myFile *pFile = streamFile;
+    uint32_t keepClus = (streamWritten == 0) ? 1 : (streamWritten + clusBytes - 1) / clusBytes;
+
+    // the chain may run on past the region when a longer run was reserved
+    uint32_t lastClus = streamFirstClus + keepClus - 1;
+    uint32_t tailClus = fatNextClus(lastClus);
+    fatSetNextClus(lastClus, FAT_EOC);
+    if (!fatFreeChain(tailClus))
+        done = false;
+
+    pFile->DIR_FileSize = streamWritten;
+    pFile->extents.cnt = 0;
+    streamFile = NULL;
+
+    if (!storeDirEntry(pFile) || !cacheSync())
+        return false;
+    return done;
+}
+
+/**
+ * @brief Back-pressure counters of the current or last stream
+ */
+fsStreamStats_t streamStats()
+{
+    return streamStat;
+}
+
 bool fileDelete(const char *path, const char *filename)
 {
+    API_STATS(FS_API_FILE_DELETE);
     myFile pathDir;
 
     myFile tempFile = pathExists(path);
@@ -1183,48 +2507,282 @@ bool fileDelete(const char *path, const char *filename)
             lfnEntCnt += 1;
     }
 
-    if (SD_readSector(startSecOfClus(tempFile.fileEntInf.Cluster) + tempFile.fileEntInf.sectorIndex, SD_buff) == SD_READ_SUCCESS)
+    uint8_t *buf = cacheWrite(startSecOfClus(tempFile.fileEntInf.Cluster) + tempFile.fileEntInf.sectorIndex);
+    if (buf != NULL)
     {
         for (uint8_t i = 0; i < (lfnEntCnt + 1); i++)
         {
-            myFile *p_temp = (myFile *)(SD_buff + (tempFile.fileEntInf.entryIndex - i) * 32);
+            myFile *p_temp = (myFile *)(buf + (tempFile.fileEntInf.entryIndex - i) * 32);
             p_temp->DIR_Name[0] = 0xE5;
         }
 
-        if (SD_writeSector(startSecOfClus(tempFile.fileEntInf.Cluster) + tempFile.fileEntInf.sectorIndex, SD_buff) == SD_WRITE_SUCCESS)
+        uint32_t fileClus = startCluster(&tempFile);
+        if (!eraseOnDelete)
+            return fatFreeChain(fileClus) && cacheSync();
+
+        // runs are freed and committed before their data is erased, a reset
+        // in between leaves no entry or chain pointing at erased clusters
+        uint32_t lastClus = lastCluster();
+        while (fileClus >= 2 && fileClus <= lastClus)
         {
-            uint32_t fileClus = startCluster(&tempFile);
-            uint32_t tempClus;
-            while (fileClus < FAT_EOC)
+            fileExtent_t runs[FILE_EXTENTS];
+            uint8_t runCnt = 0;
+            int32_t freed = 0;
+
+            while (runCnt < FILE_EXTENTS && fileClus >= 2 && fileClus <= lastClus)
             {
-                tempClus = fileClus;
-                fileClus = fatNextClus(fileClus);
-                fatSetNextClus(tempClus, 0x00000000);
+                runs[runCnt].firstClus = fileClus;
+                runs[runCnt].clusCnt = fatContigRun(fileClus, &fileClus);
+                for (uint32_t i = 0; i < runs[runCnt].clusCnt; i++)
+                    fatSetNextClus(runs[runCnt].firstClus + i, 0x00000000);
+                freed += runs[runCnt].clusCnt;
+                runCnt++;
             }
-            // updateFSInfo(startCluster(tempFile));
-            return true;
+
+            if (!adjustFreeCount(-freed) || !cacheSync())
+                return false;
+            for (uint8_t i = 0; i < runCnt; i++)
+                eraseClusRun(runs[i].firstClus, runs[i].clusCnt);
         }
-        return false;
+        return cacheSync();
     }
     return false;
 }
 
+/**
+ * @brief Erase the clusters freed by fileDelete() so the card can reuse them without read-modify-erase
+ * @param[in] enable true to erase on delete; off by default
+ */
+void mySdFat_setEraseOnDelete(bool enable)
+{
+    eraseOnDelete = enable;
+}
+
+/**
+ * @brief Build a free space map so allocations search RAM instead of the FAT
+ *
+ * Scans the whole FAT once. With a bit per data cluster of memory the map
+ * is a bitmap, otherwise a free count per group of FAT sectors that lets
+ * full groups be skipped unread. The FSInfo free count is corrected from
+ * the scan. The map lives until the next mySdFat_init().
+ *
+ * @param[in] mem memory for the map, kept by the filesystem
+ * @param[in] bytes size of mem
+ * @return true/false returns false if mem is too small or the FAT can't be read
+ */
+bool mySdFat_buildFreeMap(void *mem, uint32_t bytes)
+{
+    uint32_t lastClus = lastCluster();
+    uint32_t fatSecs = (lastClus + 1 + 127) / 128;
+    uint32_t freeCnt = 0;
+
+    freeBits = NULL;
+    freeCounts = NULL;
+
+    // counts are 16 bit, align them
+    uint8_t *map = (uint8_t *)mem;
+    uint8_t pad = (uintptr_t)map & 1;
+    uint32_t groups = (bytes > pad) ? (bytes - pad) / 2 : 0;
+    uint32_t groupSecs = (groups == 0) ? 0 : (fatSecs + groups - 1) / groups;
+    bool bitmap = bytes >= (lastClus - 1 + 7) / 8;
+
+    if (map == NULL || (!bitmap && (groupSecs == 0 || groupSecs > 511)))
+        return false;
+
+    if (bitmap)
+        memset(map, 0, (lastClus - 1 + 7) / 8);
+    else
+    {
+        map += pad;
+        memset(map, 0, (fatSecs + groupSecs - 1) / groupSecs * 2);
+    }
+
+    // dirty FAT sectors first, the scan reads the card
+    readByteStop(readOwner);
+    if (!cacheSync() || !blockDev->readStart(FatStartSector))
+        return false;
+
+    for (uint32_t sec = 0; sec < fatSecs; sec++)
+    {
+        if (!blockDev->readNext(SD_buff))
+        {
+            blockDev->readStop();
+            return false;
+        }
+
+        for (uint8_t i = 0; i < 128; i++)
+        {
+            uint32_t clus = sec * 128 + i;
+            uint32_t ent;
+
+            // SD_buff has no alignment guarantee
+            memcpy(&ent, &SD_buff[i * 4], 4);
+            if (clus < 2 || clus > lastClus || (ent & 0x0FFFFFFF) != 0)
+                continue;
+
+            freeCnt++;
+            if (bitmap)
+                map[(clus - 2) >> 3] |= 1 << ((clus - 2) & 7);
+            else
+                ((uint16_t *)map)[sec / groupSecs]++;
+        }
+    }
+    blockDev->readStop();
+
+    if (bitmap)
+        freeBits = map;
+    else
+    {
+        freeCounts = (uint16_t *)map;
+        freeGroupSecs = groupSecs;
+    }
+
+    uint8_t *buf = cacheRead(FSInfoSector);
+    if (buf != NULL && ((FSInfo_t *)buf)->FSI_Free_Count != freeCnt)
+    {
+        buf = cacheWrite(FSInfoSector);
+        ((FSInfo_t *)buf)->FSI_Free_Count = freeCnt;
+        return cacheSync();
+    }
+    return true;
+}
+
+/**
+ * @brief Flush everything to the card so its power can be removed
+ * @return true/false returns false if pending data could not be written
+ */
+bool mySdFat_suspend()
+{
+    bool synced = mySdFat_flush();
+    return blockDev->suspend() && synced;
+}
+
+/**
+ * @brief Bring the card back after mySdFat_suspend() or a brownout
+ *
+ * Only re-initializes the card; the boot sector parameters and the clean
+ * cache entries of the mount are still valid and kept.
+ * @return true/false returns false if the card did not come back, mySdFat_init() is needed then
+ */
+bool mySdFat_resume()
+{
+    return blockDev->resume();
+}
+
+/**
+ * @brief Sector I/O and time charged to one public call since the last reset
+ * @param[in] api public call
+ */
+fsApiStats_t mySdFat_apiStats(fsApi_t api)
+{
+#if MYSDFAT_STATS
+    return apiStats[api];
+#else
+    fsApiStats_t none = {0, 0, 0, 0, 0, 0};
+    return none;
+#endif
+}
+
+/**
+ * @brief Dump device, cache and per call I/O counters over Serial
+ */
+void mySdFat_printStats()
+{
+    static const char *names[] = {"fileOpen", "fileWrite", "nextFile", "fileDelete"};
+    blockDevStats_t dev = blockDev->stats();
+    sdCacheStats_t cache = cacheStats();
+    sdCacheStats_t fatCache = fatCacheStats();
+
+    Serial.print("Device read/write cmds: ");
+    Serial.print(dev.readCmds);
+    Serial.print("/");
+    Serial.print(dev.writeCmds);
+    Serial.print(", sectors: ");
+    Serial.print(dev.sectorsRead);
+    Serial.print("/");
+    Serial.println(dev.sectorsWritten);
+
+    Serial.print("Cache hits/misses/write-backs: ");
+    Serial.print(cache.hits);
+    Serial.print("/");
+    Serial.print(cache.misses);
+    Serial.print("/");
+    Serial.println(cache.writeBacks);
+
+    Serial.print("FAT cache hits/misses/write-backs: ");
+    Serial.print(fatCache.hits);
+    Serial.print("/");
+    Serial.print(fatCache.misses);
+    Serial.print("/");
+    Serial.println(fatCache.writeBacks);
+
+#if MYSDFAT_STATS
+    for (uint8_t api = 0; api < FS_API_CNT; api++)
+    {
+        if (apiStats[api].calls == 0)
+            continue;
+        Serial.print(names[api]);
+        Serial.print(": ");
+        Serial.print(apiStats[api].calls);
+        Serial.print(" calls, sectors read/written ");
+        Serial.print(apiStats[api].sectorsRead);
+        Serial.print("/");
+        Serial.print(apiStats[api].sectorsWritten);
+        Serial.print(" in ");
+        Serial.print(apiStats[api].readCmds);
+        Serial.print("/");
+        Serial.print(apiStats[api].writeCmds);
+        Serial.print(" cmds, ");
+        Serial.print(apiStats[api].us);
+        Serial.println(" us");
+    }
+#endif
+}
+
+void mySdFat_resetStats()
+{
+#if MYSDFAT_STATS
+    memset(apiStats, 0, sizeof(apiStats));
+#endif
+    blockDev->resetStats();
+    cacheResetStats();
+}
+
+BlockDevice *mySdFat_device()
+{
+    return blockDev;
+}
+
 /**
  * @brief Funtion to initialize SD Cart and FAT parameters.
+ * @param[in] dev block device to mount; NULL keeps the current one (SPI SD card by default)
  * @return true/fasle returns true upon successful initialization;Otherse returs false.
  */
-bool mySdFat_init()
+bool mySdFat_init(BlockDevice *dev)
 {
+    if (dev != NULL)
+        blockDev = dev;
 
-    if (SD_init() == SD_INIT_ERROR)
+    if (blockDev == NULL || !blockDev->init())
         return false;
 
+    // the map and the handles belong to the previous volume
+    freeBits = NULL;
+    freeCounts = NULL;
+    readOwner = NULL;
+    for (uint8_t i = 0; i < MYSDFAT_OPEN_FILES; i++)
+        filePool[i] = File();
+
+    cacheBegin(blockDev);
+
     if (getBootSecParams())
     {
 
-        FatStartSector = BOOT_SEC_START + params.BPB_RsvdSecCnt; // 0X2020
+        FSInfoSector = VolStartSector + params.BPB_FSInfo;
+        FatStartSector = VolStartSector + params.BPB_RsvdSecCnt; // 0X2020
 
         FatSectorsCnt = params.BPB_FATSz32 * params.BPB_NumFATs;
+        fatCacheBegin(FatStartSector, params.BPB_FATSz32, params.BPB_NumFATs);
 
         RootDirStartSector = FatStartSector + FatSectorsCnt;
 
@@ -1232,7 +2790,21 @@ bool mySdFat_init()
 
         DataStartSector = RootDirStartSector + RootDirSectors; // 0X96AE
 
-        DataSectorsCnt = params.BPB_TotSec32 - DataStartSector;
+        DataSectorsCnt = params.BPB_TotSec32 - (DataStartSector - VolStartSector);
+
+        // allocation unit in clusters, left at 0 unless AUs start on clusters
+        auClusters = 0;
+        auFirstClus = 0;
+        uint32_t auSectors = blockDev->allocUnitSectors();
+        if (auSectors > params.BPB_SecPerClus && auSectors % params.BPB_SecPerClus == 0)
+        {
+            uint32_t lead = (auSectors - DataStartSector % auSectors) % auSectors;
+            if (lead % params.BPB_SecPerClus == 0)
+            {
+                auClusters = auSectors / params.BPB_SecPerClus;
+                auFirstClus = 2 + lead / params.BPB_SecPerClus;
+            }
+        }
         Serial.print("Card Size:");
         Serial.print((params.BPB_TotSec32 * 512.0) / (1024.0 * 1024.0 * 1024.0));
         Serial.println(" GB");
@@ -2,9 +2,7 @@
 #define __MYSDFAT_H
 
 #include "SD_driver.h"
-
-#define BOOT_SEC_START 0x00002000
-#define FSInfo_SEC 0x00002001
+#include "sdCache.h"
 
 #define ATTR_READ_ONLY 0x01
 #define ATTR_HIDDEN 0x02
@@ -18,6 +16,66 @@
 
 #define FAT_EOC 0x0FFFFFF8
 
+// Upper bound on clusters resolved ahead of a multiple block read
+#ifndef READ_AHEAD_MAX_CLUS
+#define READ_AHEAD_MAX_CLUS 256
+#endif
+
+// Cluster runs remembered per file, a window sliding along its chain
+#ifndef FILE_EXTENTS
+#if defined(__AVR__)
+#define FILE_EXTENTS 2
+#else
+#define FILE_EXTENTS 8
+#endif
+#endif
+
+// Handles in the pool of fileOpenHandle(), their partial sectors share
+// the SD_CACHE_ENTRIES of the sector cache
+#ifndef MYSDFAT_OPEN_FILES
+#if defined(__AVR__)
+#define MYSDFAT_OPEN_FILES 2
+#else
+#define MYSDFAT_OPEN_FILES 4
+#endif
+#endif
+
+// Sector I/O charged to each public call, 0 to leave it out
+#ifndef MYSDFAT_STATS
+#define MYSDFAT_STATS 1
+#endif
+
+typedef enum
+{
+    FS_API_FILE_OPEN,
+    FS_API_FILE_WRITE,
+    FS_API_NEXT_FILE,
+    FS_API_FILE_DELETE,
+    FS_API_CNT
+} fsApi_t;
+
+typedef struct
+{
+    uint32_t calls;
+    uint32_t readCmds;
+    uint32_t writeCmds;
+    uint32_t sectorsRead;
+    uint32_t sectorsWritten;
+    uint32_t us;
+} fsApiStats_t;
+
+// ping-pong capture counters, see streamStats()
+typedef struct
+{
+    uint32_t bytes;        // bytes taken by streamPut()
+    uint32_t droppedBytes; // bytes refused with both buffers waiting or the region full
+    uint32_t overruns;     // streamPut() calls that dropped data
+    uint32_t buffers;      // buffers written to the card
+    uint32_t writeUs;      // time spent writing buffers
+    uint32_t maxWriteUs;   // longest buffer write, the stall the buffers must cover
+    uint16_t maxFill;      // fullest the other buffer got during a write
+} fsStreamStats_t;
+
 typedef enum
 {
     FAT12,
@@ -45,6 +103,20 @@ typedef struct
 
 } FSInfo_t;
 
+// physically contiguous part of a cluster chain
+typedef struct
+{
+    uint32_t fileClus;  // index of its first cluster within the file
+    uint32_t firstClus;
+    uint32_t clusCnt;
+} fileExtent_t;
+
+typedef struct
+{
+    uint8_t cnt;
+    fileExtent_t run[FILE_EXTENTS];
+} fileExtents_t;
+
 typedef struct
 {
     char DIR_Name[8];
@@ -62,6 +134,7 @@ typedef struct
     uint32_t DIR_FileSize;
     uint32_t entryIndex;
     fileEntInf_t fileEntInf;
+    fileExtents_t extents;
 
 } myFile;
 
@@ -99,16 +172,13 @@ static inline uint8_t fileLfnEntCnt(myFile *pFile)
     return pFile->fileEntInf.LFN_EntCnt;
 }
 
-static inline void fileReset(myFile *pFile)
-{
-    // stop any on going multiple secotrs read
-    SD_readMultipleSecStop();
+BlockDevice *mySdFat_device();
 
-    // reset index;
-    pFile->entryIndex = 0;
-}
+bool mySdFat_init(BlockDevice *dev = NULL);
+
+bool mySdFat_suspend();
 
-bool mySdFat_init();
+bool mySdFat_resume();
 
 bool listDir(const char *path);
 
@@ -118,14 +188,78 @@ myFile fileOpen(const char *path, const char *filename);
 
 void fileClose(myFile *pFile);
 
-uint8_t readByte(myFile *pFile);
+int16_t readByte(myFile *pFile);
 
 myFile createDirectory(const char *path, const char *dirName);
 
 bool fileWrite(myFile *pFile, const char *data);
 
+bool fileWrite(myFile *pFile, const void *data, uint32_t len);
+
+bool fileAllocate(myFile *pFile, uint32_t bytes);
+
+bool streamBegin(myFile *pFile, uint32_t bytes, uint8_t *bufs, uint16_t bufSectors = 1);
+
+uint16_t streamPut(const void *data, uint16_t len);
+
+bool streamTask();
+
+bool streamEnd();
+
+fsStreamStats_t streamStats();
+
+// open file with its own position, any number can be used at once;
+// partial sectors go through the sector cache, whole ones straight
+// between the card and the caller's buffer
+class File
+{
+public:
+    File() { reset(); }
+
+    bool open(const char *path, const char *filename);
+    bool close();
+    bool isOpen() { return !closed; }
+
+    uint32_t read(void *buf, uint32_t len);
+    uint32_t write(const void *buf, uint32_t len);
+    bool flush();
+    bool seek(uint32_t pos);
+    uint32_t tell() { return filePos; }
+    uint32_t size() { return entry.DIR_FileSize; }
+    uint32_t available() { return entry.DIR_FileSize - filePos; }
+
+private:
+    friend File *fileOpenHandle(const char *path, const char *filename);
+
+    myFile entry;
+    uint32_t filePos;
+    uint32_t clusIdx; // cluster index within the file of clus
+    uint32_t clus;    // 0 until the cluster of filePos is looked up
+    bool closed;
+    bool entryDirty;  // size changed since the last flush()
+
+    void reset();
+    bool open(const myFile *dirEnt);
+};
+
+File *fileOpenHandle(const char *path, const char *filename);
+
+bool fileCloseHandle(File *pFile);
+
+bool mySdFat_flush();
+
 bool fileDelete(const char *path, const char *filename);
 
+void mySdFat_setEraseOnDelete(bool enable);
+
+bool mySdFat_buildFreeMap(void *mem, uint32_t bytes);
+
+fsApiStats_t mySdFat_apiStats(fsApi_t api);
+
+void mySdFat_printStats();
+
+void mySdFat_resetStats();
+
 myFile nextFile(myFile *pFile);
 
 void fileReset(myFile *pFile);
@@ -0,0 +1,367 @@
+#include <stdint.h>
+#include <string.h>
+#include "sdCache.h"
+
+// data comes first so it is 4 byte aligned, callers read FAT entries
+// and FSInfo fields from it as 32 bit words
+typedef struct
+{
+    uint8_t data[512];
+    uint32_t sector;
+    uint32_t lastUse;
+    bool valid;
+    bool dirty;
+} cacheEntry_t;
+
+// a set of entries with its own LRU order
+typedef struct
+{
+    cacheEntry_t *entries;
+    uint8_t count;
+    sdCacheStats_t stats;
+} cachePool_t;
+
+static BlockDevice *cacheDev;
+static cacheEntry_t cache[SD_CACHE_ENTRIES];
+static cachePool_t dataPool = {cache, SD_CACHE_ENTRIES};
+#if SD_FAT_CACHE_ENTRIES
+static cacheEntry_t fatCache[SD_FAT_CACHE_ENTRIES];
+static cachePool_t fatPool = {fatCache, SD_FAT_CACHE_ENTRIES};
+#endif
+static uint32_t useTick;
+
+// first FAT and the number of copies following it, see fatCacheBegin()
+static uint32_t fatStart;
+static uint32_t fatSectors;
+static uint8_t fatCopies;
+
+/**
+ * @brief write a dirty entry back to the card
+ *
+ * A sector of the first FAT is written to every other FAT copy as well.
+ *
+ * @param[in] pool pool the entry belongs to
+ * @param[in] entry cache entry
+ * @return true if entry is clean afterwards
+ */
+static bool cacheFlushEntry(cachePool_t *pool, cacheEntry_t *entry)
+{
+    if (!entry->valid || !entry->dirty)
+        return true;
+
+    if (!cacheDev->writeSector(entry->sector, entry->data))
+        return false;
+
+    if (entry->sector - fatStart < fatSectors)
+    {
+        for (uint8_t i = 1; i < fatCopies; i++)
+        {
+            if (!cacheDev->writeSector(entry->sector + i * fatSectors, entry->data))
+                return false;
+        }
+    }
+
+    entry->dirty = false;
+    pool->stats.writeBacks++;
+    return true;
+}
+
+/**
+ * @brief find the entry holding a sector or claim the least recently used one
+ *
+ * @param[in] pool pool to look in
+ * @param[in] sector sector number
+ * @param[out] hit set true if the sector is already cached
+ * @return cache entry; NULL if the evicted entry could not be written back
+ */
+static cacheEntry_t *cacheLookup(cachePool_t *pool, uint32_t sector, bool *hit)
+{
+    cacheEntry_t *cache = pool->entries;
+    cacheEntry_t *victim = &cache[0];
+
+    for (uint8_t i = 0; i < pool->count; i++)
+    {
+        if (cache[i].valid && cache[i].sector == sector)
+        {
+            pool->stats.hits++;
+            cache[i].lastUse = ++useTick;
+            *hit = true;
+            return &cache[i];
+        }
+
+        if (!cache[i].valid)
+            victim = &cache[i];
+        else if (victim->valid && cache[i].lastUse < victim->lastUse)
+            victim = &cache[i];
+    }
+
+    pool->stats.misses++;
+    *hit = false;
+
+    if (!cacheFlushEntry(pool, victim))
+        return NULL;
+
+    victim->valid = false;
+    victim->sector = sector;
+    victim->lastUse = ++useTick;
+    return victim;
+}
+
+/**
+ * @brief get the cache entry of a sector, reading it on a miss
+ *
+ * @param[in] pool pool to look in
+ * @param[in] sector sector number
+ * @return cache entry; NULL on read error
+ */
+static cacheEntry_t *cacheGet(cachePool_t *pool, uint32_t sector)
+{
+    bool hit;
+    cacheEntry_t *entry = cacheLookup(pool, sector, &hit);
+
+    if (entry == NULL)
+        return NULL;
+
+    if (!hit)
+    {
+        if (!cacheDev->readSector(sector, entry->data))
+            return NULL;
+        entry->valid = true;
+        entry->dirty = false;
+    }
+    return entry;
+}
+
+/**
+ * @brief get a sector for reading
+ *
+ * The returned buffer is only valid until the next cache call.
+ *
+ * @param[in] sector sector number
+ * @return pointer to the 512 byte sector data; NULL on read error
+ */
+uint8_t *cacheRead(uint32_t sector)
+{
+    cacheEntry_t *entry = cacheGet(&dataPool, sector);
+
+    return (entry == NULL) ? NULL : entry->data;
+}
+
+/**
+ * @brief get a sector for modification; it is written back on eviction or sync
+ *
+ * @param[in] sector sector number
+ * @return pointer to the 512 byte sector data; NULL on read error
+ */
+uint8_t *cacheWrite(uint32_t sector)
+{
+    cacheEntry_t *entry = cacheGet(&dataPool, sector);
+
+    if (entry == NULL)
+        return NULL;
+
+    entry->dirty = true;
+    return entry->data;
+}
+
+/**
+ * @brief get a zero filled sector for modification without reading the card
+ *
+ * @param[in] sector sector number
+ * @return pointer to the 512 byte sector data; NULL on write back error
+ */
+uint8_t *cacheZero(uint32_t sector)
+{
+    bool hit;
+    cacheEntry_t *entry = cacheLookup(&dataPool, sector, &hit);
+
+    if (entry == NULL)
+        return NULL;
+
+    memset(entry->data, 0, sizeof(entry->data));
+    entry->valid = true;
+    entry->dirty = true;
+    return entry->data;
+}
+
+/**
+ * @brief get a FAT sector for reading from the entries kept for FAT sectors
+ *
+ * Chain walks stay cached while directory and FSInfo sectors come and go.
+ *
+ * @param[in] sector sector number inside the first FAT
+ * @return pointer to the 512 byte sector data; NULL on read error
+ */
+uint8_t *fatCacheRead(uint32_t sector)
+{
+#if SD_FAT_CACHE_ENTRIES
+    cacheEntry_t *entry = cacheGet(&fatPool, sector);
+
+    return (entry == NULL) ? NULL : entry->data;
+#else
+    return cacheRead(sector);
+#endif
+}
+
+/**
+ * @brief get a FAT sector for modification; it is written back, together
+ *        with its copies in the other FATs, on eviction or sync
+ *
+ * @param[in] sector sector number inside the first FAT
+ * @return pointer to the 512 byte sector data; NULL on read error
+ */
+uint8_t *fatCacheWrite(uint32_t sector)
+{
+#if SD_FAT_CACHE_ENTRIES
+    cacheEntry_t *entry = cacheGet(&fatPool, sector);
+
+    if (entry == NULL)
+        return NULL;
+
+    entry->dirty = true;
+    return entry->data;
+#else
+    return cacheWrite(sector);
+#endif
+}
+
+/**
+ * @brief bring cached copies up to date with sectors written around the cache
+ *
+ * Sectors written straight to the card from a caller buffer are copied
+ * into the entries holding them, so later cache reads don't see old data.
+ *
+ * @param[in] sector first sector written
+ * @param[in] buf data written, count * 512 bytes
+ * @param[in] count number of sectors
+ */
+void cacheWritten(uint32_t sector, const uint8_t *buf, uint32_t count)
+{
+    for (uint8_t i = 0; i < SD_CACHE_ENTRIES; i++)
+    {
+        if (cache[i].valid && cache[i].sector - sector < count)
+        {
+            memcpy(cache[i].data, buf + (cache[i].sector - sector) * 512, 512);
+            cache[i].dirty = false;
+        }
+    }
+}
+
+/**
+ * @brief lay sectors changed in the cache over data read around it
+ *
+ * @param[in] sector first sector read
+ * @param[in,out] buf data read from the card, count * 512 bytes
+ * @param[in] count number of sectors
+ */
+void cacheMerge(uint32_t sector, uint8_t *buf, uint32_t count)
+{
+    for (uint8_t i = 0; i < SD_CACHE_ENTRIES; i++)
+    {
+        if (cache[i].valid && cache[i].dirty && cache[i].sector - sector < count)
+            memcpy(buf + (cache[i].sector - sector) * 512, cache[i].data, 512);
+    }
+}
+
+/**
+ * @brief write the dirty sectors of a pool to the card
+ *
+ * @param[in] pool pool to flush
+ * @return true if every sector was written
+ */
+static bool cacheSyncPool(cachePool_t *pool)
+{
+    bool ret = true;
+
+    for (uint8_t i = 0; i < pool->count; i++)
+    {
+        if (!cacheFlushEntry(pool, &pool->entries[i]))
+            ret = false;
+    }
+    return ret;
+}
+
+/**
+ * @brief write all dirty sectors to the card
+ *
+ * @return true if every sector was written
+ */
+bool cacheSync()
+{
+    bool ret = cacheSyncPool(&dataPool);
+
+#if SD_FAT_CACHE_ENTRIES
+    if (!cacheSyncPool(&fatPool))
+        ret = false;
+#endif
+    return ret;
+}
+
+/**
+ * @brief attach the cache to a device, dropping anything cached
+ *
+ * @param[in] dev device the cache reads from and writes back to
+ */
+void cacheBegin(BlockDevice *dev)
+{
+    cacheDev = dev;
+    fatSectors = 0;
+    fatCopies = 0;
+    cacheInvalidate();
+}
+
+/**
+ * @brief tell the cache where the FATs are so their copies stay in step
+ *
+ * @param[in] start first sector of the first FAT
+ * @param[in] sectors sectors per FAT
+ * @param[in] copies number of FATs, BPB_NumFATs
+ */
+void fatCacheBegin(uint32_t start, uint32_t sectors, uint8_t copies)
+{
+    fatStart = start;
+    fatSectors = sectors;
+    fatCopies = copies;
+}
+
+/**
+ * @brief drop every cached sector without writing it back
+ */
+void cacheInvalidate()
+{
+    for (uint8_t i = 0; i < SD_CACHE_ENTRIES; i++)
+    {
+        cache[i].valid = false;
+        cache[i].dirty = false;
+    }
+#if SD_FAT_CACHE_ENTRIES
+    for (uint8_t i = 0; i < SD_FAT_CACHE_ENTRIES; i++)
+    {
+        fatCache[i].valid = false;
+        fatCache[i].dirty = false;
+    }
+#endif
+}
+
+sdCacheStats_t cacheStats()
+{
+    return dataPool.stats;
+}
+
+sdCacheStats_t fatCacheStats()
+{
+#if SD_FAT_CACHE_ENTRIES
+    return fatPool.stats;
+#else
+    sdCacheStats_t none = {0, 0, 0};
+    return none;
+#endif
+}
+
+void cacheResetStats()
+{
+    memset(&dataPool.stats, 0, sizeof(dataPool.stats));
+#if SD_FAT_CACHE_ENTRIES
+    memset(&fatPool.stats, 0, sizeof(fatPool.stats));
+#endif
+}
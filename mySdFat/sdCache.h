@@ -0,0 +1,63 @@
+#ifndef __SDCACHE_H
+#define __SDCACHE_H
+
+#include <stdint.h>
+#include "blockDevice.h"
+
+// Number of 512 byte sectors held in the cache. Override before including
+// to trade RAM for fewer card accesses.
+#ifndef SD_CACHE_ENTRIES
+#if defined(__AVR__)
+#define SD_CACHE_ENTRIES 1
+#else
+#define SD_CACHE_ENTRIES 8
+#endif
+#endif
+
+// Sectors kept apart for FAT sectors, so chain walks are not evicted by
+// directory and FSInfo traffic. 0 shares the entries above, the AVR
+// default as RAM is short there.
+#ifndef SD_FAT_CACHE_ENTRIES
+#if defined(__AVR__)
+#define SD_FAT_CACHE_ENTRIES 0
+#else
+#define SD_FAT_CACHE_ENTRIES 4
+#endif
+#endif
+
+typedef struct
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t writeBacks;
+} sdCacheStats_t;
+
+void cacheBegin(BlockDevice *dev);
+
+uint8_t *cacheRead(uint32_t sector);
+
+uint8_t *cacheWrite(uint32_t sector);
+
+uint8_t *cacheZero(uint32_t sector);
+
+void fatCacheBegin(uint32_t start, uint32_t sectors, uint8_t copies);
+
+uint8_t *fatCacheRead(uint32_t sector);
+
+uint8_t *fatCacheWrite(uint32_t sector);
+
+void cacheWritten(uint32_t sector, const uint8_t *buf, uint32_t count);
+
+void cacheMerge(uint32_t sector, uint8_t *buf, uint32_t count);
+
+bool cacheSync();
+
+void cacheInvalidate();
+
+sdCacheStats_t cacheStats();
+
+sdCacheStats_t fatCacheStats();
+
+void cacheResetStats();
+
+#endif
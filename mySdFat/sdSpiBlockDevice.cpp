@@ -0,0 +1,94 @@
+#if defined(ARDUINO)
+#include <Arduino.h>
+#include "SD_driver.h"
+#include "blockDevice.h"
+
+bool SdSpiBlockDevice::begin()
+{
+    return SD_init() == SD_INIT_SUCCESS;
+}
+
+uint32_t SdSpiBlockDevice::sectorCount()
+{
+    return SD_getCardInfo().sectors;
+}
+
+uint32_t SdSpiBlockDevice::allocUnitSectors()
+{
+    // AU_SIZE from the SD Status register
+    return SD_getStatus().auSectors;
+}
+
+bool SdSpiBlockDevice::readBlocks(uint32_t sector, uint8_t *buf, uint32_t count)
+{
+    if (count == 1)
+        return SD_readSector(sector, buf) == SD_READ_SUCCESS;
+    return SD_readSectors(sector, count, buf) == SD_READ_SUCCESS;
+}
+
+bool SdSpiBlockDevice::writeBlocks(uint32_t sector, const uint8_t *buf, uint32_t count)
+{
+    if (count == 1)
+        return SD_writeSector(sector, (uint8_t *)buf) == SD_WRITE_SUCCESS;
+    return SD_writeSectors(sector, buf, count) == SD_WRITE_SUCCESS;
+}
+
+bool SdSpiBlockDevice::eraseBlocks(uint32_t sector, uint32_t count)
+{
+    if (count == 0)
+        return true;
+    return SD_eraseSectors(sector, sector + count - 1) == SD_ERASE_SUCCESS;
+}
+
+bool SdSpiBlockDevice::sleepDevice()
+{
+    return SD_suspend() == SD_WRITE_SUCCESS;
+}
+
+bool SdSpiBlockDevice::wakeDevice()
+{
+    // minimal re-init with the card parameters of the last SD_init()
+    return SD_resume() == SD_INIT_SUCCESS;
+}
+
+bool SdSpiBlockDevice::streamStart(uint32_t sector)
+{
+    if (SD_readMultipleSecStart(sector) == SD_READY)
+        return true;
+
+    // CMD18 rejected, chip select is still asserted
+    SD_readMultipleSecStop();
+    return false;
+}
+
+bool SdSpiBlockDevice::streamRead(uint8_t *buf)
+{
+    return SD_readMultipleSec(buf) == SD_READ_SUCCESS;
+}
+
+void SdSpiBlockDevice::streamStop()
+{
+    SD_readMultipleSecStop();
+}
+
+bool SdSpiBlockDevice::writeStreamStart(uint32_t sector, uint32_t count)
+{
+    // CMD25 rejected, chip select is already released
+    return SD_writeMultipleSecStart(sector, count) == SD_READY;
+}
+
+bool SdSpiBlockDevice::writeStreamWrite(const uint8_t *buf)
+{
+    return SD_writeMultipleSec(buf) == SD_WRITE_SUCCESS;
+}
+
+bool SdSpiBlockDevice::writeStreamStop()
+{
+    return SD_writeMultipleSecStop() == SD_WRITE_SUCCESS;
+}
+
+void SdSpiBlockDevice::streamIdle()
+{
+    SD_yield();
+}
+#endif
@@ -0,0 +1,360 @@
+// Host tests of mySdFat on FAT32 images through FileBlockDevice, see Makefile
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "mySdFat.h"
+
+#define IMG_PATH "fsHostTest.img"
+
+// 1 sector clusters, enough of them for FAT32
+#define IMG_CLUSTERS 66000UL
+#define IMG_RSVD 32
+#define IMG_FATS 2
+#define IMG_FAT_SECS ((IMG_CLUSTERS + 2) * 4 / 512 + 1)
+
+static int failures = 0;
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+static void writeSec(int fd, uint32_t sector, const uint8_t *buf)
+{
+    if (pwrite(fd, buf, 512, (off_t)sector * 512) != 512)
+        perror(IMG_PATH);
+}
+
+/**
+ * @brief  Format an empty FAT32 volume into IMG_PATH
+ *
+ * @param[in] volStart sector of the boot sector, 0 leaves out the MBR
+ */
+static void makeVolume(uint32_t volStart)
+{
+    uint32_t dataStart = volStart + IMG_RSVD + IMG_FATS * IMG_FAT_SECS;
+    uint32_t volSecs = dataStart - volStart + IMG_CLUSTERS;
+    uint8_t sec[512];
+
+    int fd = open(IMG_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)(volStart + volSecs) * 512) != 0)
+    {
+        perror(IMG_PATH);
+        return;
+    }
+
+    if (volStart != 0)
+    {
+        memset(sec, 0, 512);
+        sec[446 + 4] = 0x0C; // FAT32 LBA
+        put32(&sec[446 + 8], volStart);
+        put32(&sec[446 + 12], volSecs);
+        sec[510] = 0x55;
+        sec[511] = 0xAA;
+        writeSec(fd, 0, sec);
+    }
+
+    memset(sec, 0, 512);
+    sec[0] = 0xEB;
+    sec[1] = 0x58;
+    sec[2] = 0x90;
+    put16(&sec[11], 512);
+    sec[13] = 1;
+    put16(&sec[14], IMG_RSVD);
+    sec[16] = IMG_FATS;
+    put32(&sec[32], volSecs);
+    put32(&sec[36], IMG_FAT_SECS);
+    put32(&sec[44], 2);
+    put16(&sec[48], 1);
+    memcpy(&sec[71], "HOSTTEST   ", 11);
+    memcpy(&sec[82], "FAT32   ", 8);
+    sec[510] = 0x55;
+    sec[511] = 0xAA;
+    writeSec(fd, volStart, sec);
+
+    memset(sec, 0, 512);
+    put32(&sec[0], 0x41615252);
+    put32(&sec[484], 0x61417272);
+    put32(&sec[488], IMG_CLUSTERS - 1);
+    put32(&sec[492], 3);
+    put32(&sec[508], 0xAA550000);
+    writeSec(fd, volStart + 1, sec);
+
+    // media, reserved and the root directory cluster
+    memset(sec, 0, 512);
+    put32(&sec[0], 0x0FFFFFF8);
+    put32(&sec[4], 0x0FFFFFFF);
+    put32(&sec[8], 0x0FFFFFFF);
+    for (uint32_t i = 0; i < IMG_FATS; i++)
+        writeSec(fd, volStart + IMG_RSVD + i * IMG_FAT_SECS, sec);
+
+    // the root directory starts with the volume label, as formatters leave it
+    memset(sec, 0, 512);
+    memcpy(&sec[0], "HOSTTEST   ", 11);
+    sec[11] = ATTR_VOLUME_ID;
+    writeSec(fd, dataStart, sec);
+
+    close(fd);
+}
+
+/**
+ * @brief  Clusters the first FAT of the image has in use, root included
+ */
+static uint32_t fatUsedCount(uint32_t volStart)
+{
+    uint8_t sec[512];
+    uint32_t used = 0;
+
+    int fd = open(IMG_PATH, O_RDONLY);
+    for (uint32_t s = 0; s < IMG_FAT_SECS; s++)
+    {
+        if (pread(fd, sec, 512, (off_t)(volStart + IMG_RSVD + s) * 512) != 512)
+            break;
+        for (uint32_t i = 0; i < 128; i++)
+        {
+            uint32_t clus = s * 128 + i;
+            uint32_t ent;
+            memcpy(&ent, &sec[i * 4], 4);
+            if (clus >= 2 && clus < IMG_CLUSTERS + 2 && (ent & 0x0FFFFFFF) != 0)
+                used++;
+        }
+    }
+    close(fd);
+    return used;
+}
+
+/**
+ * @brief  Free cluster count of the FSInfo sector of the image
+ */
+static uint32_t fsInfoFree(uint32_t volStart)
+{
+    uint8_t sec[512];
+    uint32_t freeCnt = 0;
+
+    int fd = open(IMG_PATH, O_RDONLY);
+    if (pread(fd, sec, 512, (off_t)(volStart + 1) * 512) == 512)
+        memcpy(&freeCnt, &sec[488], 4);
+    close(fd);
+    return freeCnt;
+}
+
+/**
+ * @brief  Write a file, then read it back before and after mounting again
+ */
+static void testReadBack(uint32_t volStart)
+{
+    static uint8_t data[3000], back[3000];
+    for (uint32_t i = 0; i < sizeof(data); i++)
+        data[i] = (uint8_t)(i * 7 + i / 512);
+
+    makeVolume(volStart);
+    FileBlockDevice dev(IMG_PATH);
+    CHECK(mySdFat_init(&dev));
+
+    myFile f = fileOpen("/", "host.bin");
+    CHECK(startCluster(&f) != 0);
+    CHECK(fileWrite(&f, data, sizeof(data)));
+    fileClose(&f);
+    CHECK(mySdFat_flush());
+
+    File r;
+    CHECK(r.open("/", "host.bin"));
+    CHECK(r.size() == sizeof(data));
+    CHECK(r.read(back, sizeof(back)) == sizeof(data));
+    CHECK(memcmp(back, data, sizeof(data)) == 0);
+    r.close();
+
+    FileBlockDevice again(IMG_PATH);
+    CHECK(mySdFat_init(&again));
+    memset(back, 0, sizeof(back));
+    CHECK(r.open("/", "host.bin"));
+    CHECK(r.read(back, sizeof(back)) == sizeof(data));
+    CHECK(memcmp(back, data, sizeof(data)) == 0);
+    r.close();
+
+    // root and the clusters of the file
+    CHECK(fatUsedCount(volStart) == 1 + (sizeof(data) + 511) / 512);
+}
+
+/**
+ * @brief  Reserving again for an empty file replaces the earlier reservation
+ */
+static void testAllocateTwice()
+{
+    makeVolume(0);
+    FileBlockDevice dev(IMG_PATH);
+    CHECK(mySdFat_init(&dev));
+
+    myFile f = fileOpen("/", "alloc.bin");
+    CHECK(fileAllocate(&f, 100 * 512));
+    CHECK(fatUsedCount(0) == 1 + 100);
+    CHECK(fileAllocate(&f, 300 * 512));
+    CHECK(fatUsedCount(0) == 1 + 300);
+    CHECK(fsInfoFree(0) == IMG_CLUSTERS - 1 - 300);
+
+    // a smaller request keeps the run there is
+    uint32_t firstClus = startCluster(&f);
+    CHECK(fileAllocate(&f, 50 * 512));
+    CHECK(startCluster(&f) == firstClus);
+    CHECK(fatUsedCount(0) == 1 + 300);
+
+    CHECK(fileWrite(&f, "abc", 3));
+    fileClose(&f);
+    CHECK(mySdFat_flush());
+    File r;
+    char back[4] = {0};
+    CHECK(r.open("/", "alloc.bin"));
+    CHECK(r.read(back, 3) == 3 && strcmp(back, "abc") == 0);
+    r.close();
+}
+
+/**
+ * @brief  A stream into a file reserved by fileAllocate() writes that run
+ */
+static void testStreamAfterAllocate()
+{
+    static uint8_t bufs[2 * 512];
+    static uint8_t data[1500], back[1500];
+    for (uint32_t i = 0; i < sizeof(data); i++)
+        data[i] = (uint8_t)(i * 13);
+
+    makeVolume(0);
+    FileBlockDevice dev(IMG_PATH);
+    CHECK(mySdFat_init(&dev));
+
+    myFile f = fileOpen("/", "cap.bin");
+    CHECK(fileAllocate(&f, 100 * 512));
+    uint32_t firstClus = startCluster(&f);
+
+    CHECK(streamBegin(&f, 40 * 512, bufs, 1));
+    CHECK(startCluster(&f) == firstClus);
+    CHECK(fatUsedCount(0) == 1 + 100);
+
+    for (uint32_t put = 0; put < sizeof(data); put += 300)
+    {
+        uint16_t len = (sizeof(data) - put < 300) ? sizeof(data) - put : 300;
+        CHECK(streamPut(data + put, len) == len);
+        CHECK(streamTask());
+    }
+    CHECK(streamEnd());
+    CHECK(fileSize(&f) == sizeof(data));
+
+    // the clusters past the data go back, whatever was reserved
+    CHECK(fatUsedCount(0) == 1 + (sizeof(data) + 511) / 512);
+    CHECK(fsInfoFree(0) == IMG_CLUSTERS - 1 - (sizeof(data) + 511) / 512);
+
+    File r;
+    CHECK(r.open("/", "cap.bin"));
+    CHECK(r.read(back, sizeof(back)) == sizeof(data));
+    CHECK(memcmp(back, data, sizeof(data)) == 0);
+    r.close();
+}
+
+/**
+ * @brief  Deleting gives the chain back to the FAT and the FSInfo count
+ */
+static void testDelete(bool erase)
+{
+    static uint8_t data[20 * 512];
+    memset(data, 0x5A, sizeof(data));
+
+    makeVolume(0);
+    FileBlockDevice dev(IMG_PATH);
+    CHECK(mySdFat_init(&dev));
+    mySdFat_setEraseOnDelete(erase);
+
+    // two files written in turns, so the chains are fragmented
+    myFile a = fileOpen("/", "a.bin");
+    myFile b = fileOpen("/", "b.bin");
+    for (uint32_t i = 0; i < sizeof(data); i += 512)
+    {
+        CHECK(fileWrite(&a, data + i, 512));
+        CHECK(fileWrite(&b, data + i, 512));
+    }
+    fileClose(&a);
+    fileClose(&b);
+    CHECK(mySdFat_flush());
+    CHECK(fatUsedCount(0) == 1 + 2 * sizeof(data) / 512);
+
+    dev.resetStats();
+    CHECK(fileDelete("/", "a.bin"));
+    CHECK(fatUsedCount(0) == 1 + sizeof(data) / 512);
+    CHECK(fsInfoFree(0) == IMG_CLUSTERS - 1 - sizeof(data) / 512);
+    CHECK(dev.stats().sectorsErased == (erase ? sizeof(data) / 512 : 0));
+
+    File r;
+    CHECK(r.open("/", "b.bin") && r.size() == sizeof(data));
+    r.close();
+    mySdFat_setEraseOnDelete(false);
+}
+
+/**
+ * @brief  readByte() sees what File::write() left in the cache
+ */
+static void testReadByteUnflushed()
+{
+    static uint8_t data[1200];
+    for (uint32_t i = 0; i < sizeof(data); i++)
+        data[i] = (uint8_t)(i * 3);
+
+    makeVolume(0);
+    FileBlockDevice dev(IMG_PATH);
+    CHECK(mySdFat_init(&dev));
+
+    File w;
+    CHECK(w.open("/", "dirty.bin"));
+    CHECK(w.write(data, sizeof(data)) == sizeof(data));
+    CHECK(w.flush());
+
+    // overwritten in the cache only, across a sector boundary
+    memset(data + 500, 0xA5, 100);
+    CHECK(w.seek(500));
+    CHECK(w.write(data + 500, 100) == 100);
+
+    myFile r = fileOpen("/", "dirty.bin");
+    bool same = true;
+    for (uint32_t i = 0; i < sizeof(data); i++)
+        same = same && readByte(&r) == data[i];
+    CHECK(same);
+    fileClose(&r);
+    w.close();
+}
+
+int main()
+{
+    testReadBack(2048);
+    testReadBack(0);
+    testAllocateTwice();
+    testStreamAfterAllocate();
+    testDelete(false);
+    testDelete(true);
+    testReadByteUnflushed();
+
+    unlink(IMG_PATH);
+    if (failures != 0)
+    {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <Arduino.h> 
 #include <myOled.h>
+#include "SPI_bus.h"
 
 
 const uint8_t channel[3]   = {37,38,39};  // logical BTLE channel number (37-39)
@@ -335,11 +336,16 @@ void NRF24_BLE::handle_timer_isr()
    }
 }
 
-static void  NRF24_BLE::invoke_isr()
+void  NRF24_BLE::invoke_isr()
 {
 	if(isr_handler)
-	 
+	{
+	   //SD transfer in progress, hop once the bus is released
+	   if(BUS_isBusy())
+	      BUS_defer(isr_handler->radio->bus_device(), invoke_isr);
+	   else
 	      isr_handler->handle_timer_isr();
+	}
 }
 void timer_handle_interrupts(int timer){
 
@@ -1,24 +1,43 @@
 #include <SPI.h>
 #include "nrf24_radio.h"
+#include "SPI_bus.h"
 #include <Arduino.h>
 
 
+bool NRF24_RADIO::select()
+{
+	//bus kept by a device that can't be asked to let go
+	if(!BUS_acquire(bus_dev))
+	   return false;
+	cs.low();
+	return true;
+}
+
+void NRF24_RADIO::deselect()
+{
+	cs.high();
+	BUS_release(bus_dev);
+}
+
+
 void NRF24_RADIO::write_register(uint8_t reg_address, uint8_t* reg_value, uint8_t byte_cnt)
 {
-	digitalWrite(CS_pin, LOW);
+	if(!select())
+	   return;
 	SPI.transfer(reg_address | W_REGISTER);
 	for(uint8_t i=0; i<byte_cnt;i++)
 	   SPI.transfer(reg_value[i]);
-	digitalWrite(CS_pin, HIGH);
+	deselect();
 }
 
 void NRF24_RADIO::read_register(uint8_t reg_address, uint8_t* reg_value)
 {
-	digitalWrite(CS_pin, LOW);
+	if(!select())
+	   return;
 	SPI.transfer(reg_address| R_REGISTER);
 	*reg_value=SPI.transfer(0x00);
 
-	digitalWrite(CS_pin, HIGH);
+	deselect();
 }
 
 void NRF24_RADIO::clear_irq_flags(uint8_t flags)
@@ -30,27 +49,29 @@ void NRF24_RADIO::clear_irq_flags(uint8_t flags)
 uint8_t NRF24_RADIO::read_status() //Read Radio Status register
 {
 	uint8_t radio_status;
-	digitalWrite(CS_pin, LOW);
+	if(!select())
+	   return 0;
 	radio_status=SPI.transfer(NOP);
-    digitalWrite(CS_pin, HIGH);
+    deselect();
 
     return radio_status;
 }
 
 bool NRF24_RADIO::nrf24_tx(uint8_t* buffer, uint8_t length)
 {
-	digitalWrite(CS_pin, LOW);
+	if(!select())
+	   return false;
 	SPI.transfer(W_TX_PAYLOAD);
 
 	for(uint8_t i=0;i<length;i++)
 	   SPI.transfer(buffer[i]);
 	for(uint8_t i=0;i<32-length;i++)
 		 SPI.transfer(0x00);
-	digitalWrite(CS_pin, HIGH);
+	deselect();
     
-	digitalWrite(CE_pin, HIGH);
+	ce.high();
     delayMicroseconds(10);
-    digitalWrite(CE_pin, LOW);
+    ce.low();
 
 	while(!((read_status() >>TX_DS) & 0x01))
 	{
@@ -74,18 +95,19 @@ bool NRF24_RADIO::nrf24_tx(uint8_t* buffer, uint8_t length)
 
 void NRF24_RADIO::nrf24_tx_no_ack(uint8_t* buffer, uint8_t length)
 {
-	digitalWrite(CS_pin, LOW);
+	if(!select())
+	   return;
 	SPI.transfer(W_TX_PAYLOAD_NO_ACK);
 
 	for(uint8_t i=0;i<length;i++)
 	   SPI.transfer(buffer[i]);
 	for(uint8_t i=0;i<32-length;i++)
 		 SPI.transfer(0x00);
-	digitalWrite(CS_pin, HIGH);
+	deselect();
     
-	digitalWrite(CE_pin, HIGH);
+	ce.high();
     delayMicroseconds(10);
-    digitalWrite(CE_pin, LOW);
+    ce.low();
 
      while(!((read_status() >>TX_DS) & 0x01));
 	clear_irq_flags(((1<<TX_DS)|(1<<RX_DR)|(1<<MAX_RT)));
@@ -142,14 +164,15 @@ void NRF24_RADIO::nrf24_rx(uint8_t* buffer, uint8_t length)
 
    //Read data bytes equal to lenght of receive buffer and store in buffe  
 
-  	digitalWrite(CS_pin, LOW);
+  	if(!select())
+  	   return;
     SPI.transfer(R_RX_PAYLOAD);
    for(uint8_t i=0; i<length;i++)
    	 buffer[i]=SPI.transfer(0xFF);
     //read reamaining bytes. no need to store
    for(uint8_t i=0; i<32-length;i++)
    	   SPI.transfer(0xFF);
-   digitalWrite(CS_pin, HIGH);
+   deselect();
 
    clear_irq_flags(_BV(RX_DR));
 }
@@ -164,7 +187,7 @@ void NRF24_RADIO::set_mode(radio_mode_t mode)
 		break;
 		
 		case RX_MODE:
-		digitalWrite(CE_pin, HIGH);
+		ce.high();
 		nrf24_reg.REG_CONFIG|=0X01;
 		break;
 
@@ -362,16 +385,18 @@ void NRF24_RADIO::enable_rx_pipe(uint8_t pipe)
 
 void NRF24_RADIO::flush_tx()
 {
-    digitalWrite(CS_pin, LOW);
+    if(!select())
+       return;
 	SPI.transfer(FLUSH_TX);
-	digitalWrite(CS_pin, HIGH);
+	deselect();
 }
 
 void NRF24_RADIO::flush_rx()
 {
-    digitalWrite(CS_pin, LOW);
+    if(!select())
+       return;
 	SPI.transfer(FLUSH_RX);
-	digitalWrite(CS_pin, HIGH);
+	deselect();
 }
 
 
@@ -399,11 +424,10 @@ void NRF24_RADIO::enable_ack_payload()
 
 void NRF24_RADIO::init()
 {
-	SPI.begin();
-	SPI.setDataMode(SPI_MODE0);
+	bus_dev=BUS_register(CS_pin, NRF24_SPI_CLOCK, SPI_MODE0, BUS_PRIO_HIGH);
 	pinMode(CE_pin, OUTPUT);
-	pinMode(CS_pin, OUTPUT);
-	digitalWrite(CS_pin, HIGH);
+	ce.attach(CE_pin);
+	cs.attach(CS_pin);
 	memset(&nrf24_reg,0,sizeof(nrf24_reg));
     
 	delay(5);
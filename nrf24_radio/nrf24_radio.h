@@ -1,6 +1,7 @@
 #ifndef _NRF24_RADIO
 #define _NRF24_RADIO
 #include "stdint.h"
+#include "fastPin.h"
 //Register command
 #define R_REGISTER 0x00
 #define W_REGISTER 0x20
@@ -15,6 +16,11 @@
 #define W_TX_PAYLOAD_NO_ACK 0xB0
 #define NOP 0xFF
 
+//SPI clock, the chip allows up to 10MHz
+#ifndef NRF24_SPI_CLOCK
+#define NRF24_SPI_CLOCK 8000000UL
+#endif
+
 //register map
 #define CONFIG 0x00
 #define EN_AA 0x01
@@ -117,9 +123,15 @@ public:
   void flush_tx();
  void flush_rx();
  void enable_dynamic_ack();
+ uint8_t bus_device() { return bus_dev; }
 private:
  uint8_t CE_pin;
  uint8_t CS_pin;
+ uint8_t bus_dev;
+ CachedPin ce;
+ CachedPin cs;
+ bool select();
+ void deselect();
  nrf24_register_t nrf24_reg;
  void set_crc_encoding(uint8_t byte_cnt);
  void read_register(uint8_t reg_address, uint8_t* reg_value);
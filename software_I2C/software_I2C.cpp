@@ -11,22 +11,27 @@
 
 #include <Arduino.h>
 #include "software_I2C.h"
+#include "fastPin.h"
 
 
 #define I2C_DELAY delayMicroseconds(5) //Choose delay according to the I2C speed requirements.
-#define SET_SDA  pinMode(i2c_sda, INPUT)
-#define CLEAR_SDA pinMode(i2c_sda, OUTPUT)
+#define SET_SDA  sda_pin.input()
+#define CLEAR_SDA sda_pin.output()
                   
-#define SET_SCL  pinMode(i2c_scl, INPUT)
-#define CLEAR_SCL pinMode(i2c_scl, OUTPUT)
+#define SET_SCL  scl_pin.input()
+#define CLEAR_SCL scl_pin.output()
 
 uint8_t i2c_scl;
 uint8_t i2c_sda;
 uint8_t ack;
 
+//port and mask of the lines, looked up once in i2c_init()
+static CachedPin sda_pin;
+static CachedPin scl_pin;
+
 uint8_t read_scl() //read SCL line
 {
-	return digitalRead(i2c_scl);
+	return scl_pin.read();
 
 }
 
@@ -37,7 +42,7 @@ bool read_ack() //read acknowledgement
   SET_SCL;
   while(read_scl()==LOW); //Clock stretching
   I2C_DELAY;
-  ack=digitalRead(i2c_sda);
+  ack=sda_pin.read();
   CLEAR_SCL;
   I2C_DELAY;
   return ack;
@@ -49,6 +54,14 @@ void i2c_init(uint8_t sda, uint8_t scl) //Initialize I2C bus
 {
 	i2c_sda=sda;
 	i2c_scl=scl;
+	sda_pin.attach(sda);
+	scl_pin.attach(scl);
+
+	//open drain: released as input, pulled low by enabling a low output
+	pinMode(sda, INPUT);
+	pinMode(scl, INPUT);
+	sda_pin.low();
+	scl_pin.low();
 }
 
 